@@ -0,0 +1,6 @@
+# Benchmark workload, see bench.s
+l "bench/bench.hex"
+b 104c
+. 100000000
+pc
+x9
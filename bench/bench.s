@@ -0,0 +1,123 @@
+# Benchmark workload for rv64sim: a mix of byte, word and doubleword memory
+# accesses, branches and calls, built from a sieve, a sort and a recursive fib.
+# Assemble with: llvm-mc -triple=riscv64 -filetype=obj bench.s
+# The checksum of all iterations is left in s1.
+
+  .text
+  .globl _start
+_start:
+  li sp, 0x80000
+  li s0, 100            # iterations
+  li s1, 0              # checksum
+  li s2, 0x2545F491     # xorshift state
+main_loop:
+  call sieve
+  add s1, s1, a0
+  call fill
+  call sort
+  add s1, s1, a0
+  li a0, 16
+  call fib
+  add s1, s1, a0
+  addi s0, s0, -1
+  bnez s0, main_loop
+done:
+  j done
+
+# Count the primes below 8192 with a byte array sieve at 0x20000
+sieve:
+  li t0, 0x20000
+  li t1, 8192
+  li t2, 0
+1:add t3, t0, t2
+  li t4, 1
+  sb t4, 0(t3)
+  addi t2, t2, 1
+  blt t2, t1, 1b
+  sb zero, 0(t0)
+  sb zero, 1(t0)
+  li t2, 2
+2:add t3, t0, t2
+  lbu t4, 0(t3)
+  beqz t4, 4f
+  add t5, t2, t2
+3:bge t5, t1, 4f
+  add t6, t0, t5
+  sb zero, 0(t6)
+  add t5, t5, t2
+  j 3b
+4:addi t2, t2, 1
+  blt t2, t1, 2b
+  li a0, 0
+  li t2, 0
+5:add t3, t0, t2
+  lbu t4, 0(t3)
+  add a0, a0, t4
+  addi t2, t2, 1
+  blt t2, t1, 5b
+  ret
+
+# Fill 256 words at 0x30000 with xorshift values
+fill:
+  li t0, 0x30000
+  li t1, 256
+1:slli t2, s2, 13
+  xor s2, s2, t2
+  srli t2, s2, 7
+  xor s2, s2, t2
+  slli t2, s2, 17
+  xor s2, s2, t2
+  sw s2, 0(t0)
+  addi t0, t0, 4
+  addi t1, t1, -1
+  bnez t1, 1b
+  ret
+
+# Insertion sort of the 256 signed words at 0x30000, returning a position-weighted sum
+sort:
+  li t0, 0x30000
+  li t1, 1
+  li t6, 256
+1:bge t1, t6, 4f
+  slli t2, t1, 2
+  add t2, t0, t2
+  lw t3, 0(t2)
+2:beq t2, t0, 3f
+  lw t4, -4(t2)
+  bge t3, t4, 3f
+  sw t4, 0(t2)
+  addi t2, t2, -4
+  j 2b
+3:sw t3, 0(t2)
+  addi t1, t1, 1
+  j 1b
+4:li a0, 0
+  li t1, 0
+5:slli t2, t1, 2
+  add t2, t0, t2
+  lw t3, 0(t2)
+  srai t3, t3, 8
+  add a0, a0, t3
+  addw a0, a0, t1
+  addi t1, t1, 1
+  blt t1, t6, 5b
+  ret
+
+# Recursive fib(a0)
+fib:
+  li t0, 2
+  blt a0, t0, 1f
+  addi sp, sp, -24
+  sd ra, 0(sp)
+  sd a0, 8(sp)
+  addi a0, a0, -1
+  call fib
+  sd a0, 16(sp)
+  ld a0, 8(sp)
+  addi a0, a0, -2
+  call fib
+  ld t0, 16(sp)
+  add a0, a0, t0
+  ld ra, 0(sp)
+  addi sp, sp, 24
+1:ret
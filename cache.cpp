@@ -0,0 +1,339 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Classes for the cache hierarchy model
+
+**************************************************************** */
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <stdlib.h>
+
+#include "cache.h"
+
+using namespace std;
+
+cache::cache(string name, uint64_t size, uint64_t line_size, uint64_t ways, replacement_policy policy, uint64_t latency)
+{
+   this->name = name;
+   this->line_size = line_size;
+   this->ways = ways;
+   this->policy = policy;
+   this->latency = latency;
+   sets = size / (line_size * ways);
+   line_shift = 0;
+   while ((1ULL << line_shift) < line_size)
+   {
+      line_shift++;
+   }
+   tags.assign(sets * ways, 0);
+   valid.assign(sets * ways, false);
+   dirty.assign(sets * ways, false);
+   last_used.assign(sets * ways, 0);
+   plru_bits.assign(sets, 0);
+   access_stamp = 0;
+   random_state = 0x9E3779B97F4A7C15ULL;
+   accesses = 0;
+   hits = 0;
+   misses = 0;
+   evictions = 0;
+   writebacks = 0;
+}
+
+// Record a use of a way for the replacement policy
+void cache::touch(uint64_t set, uint64_t way)
+{
+   switch (policy)
+   {
+   case rp_lru:
+      last_used[set * ways + way] = ++access_stamp;
+      break;
+   case rp_plru:
+   {
+      // Walk the tree from the root, pointing each node away from the way just used
+      uint64_t node = 1;
+      for (uint64_t half = ways / 2; half > 0; half /= 2)
+      {
+         bool upper = (way & half) != 0;
+         if (upper)
+         {
+            plru_bits[set] &= ~(1ULL << node);
+         }
+         else
+         {
+            plru_bits[set] |= 1ULL << node;
+         }
+         node = 2 * node + (upper ? 1 : 0);
+      }
+   }
+   break;
+   case rp_random:
+      break;
+   }
+}
+
+// Choose the way to replace in a set, preferring an invalid line
+uint64_t cache::victim(uint64_t set)
+{
+   for (uint64_t way = 0; way < ways; way++)
+   {
+      if (!valid[set * ways + way])
+      {
+         return way;
+      }
+   }
+   switch (policy)
+   {
+   case rp_lru:
+   {
+      uint64_t oldest = 0;
+      for (uint64_t way = 1; way < ways; way++)
+      {
+         if (last_used[set * ways + way] < last_used[set * ways + oldest])
+         {
+            oldest = way;
+         }
+      }
+      return oldest;
+   }
+   case rp_plru:
+   {
+      uint64_t node = 1;
+      uint64_t way = 0;
+      for (uint64_t half = ways / 2; half > 0; half /= 2)
+      {
+         if (plru_bits[set] & (1ULL << node))
+         {
+            way |= half;
+            node = 2 * node + 1;
+         }
+         else
+         {
+            node = 2 * node;
+         }
+      }
+      return way;
+   }
+   case rp_random:
+      // xorshift64, so runs are repeatable
+      random_state ^= random_state << 13;
+      random_state ^= random_state >> 7;
+      random_state ^= random_state << 17;
+      return random_state % ways;
+   }
+   return 0;
+}
+
+bool cache::access(uint64_t address, bool write, bool &evicted, uint64_t &evicted_address)
+{
+   uint64_t line = address >> line_shift;
+   uint64_t set = line % sets;
+   uint64_t tag = line / sets;
+   accesses++;
+   evicted = false;
+   for (uint64_t way = 0; way < ways; way++)
+   {
+      uint64_t index = set * ways + way;
+      if (valid[index] && tags[index] == tag)
+      {
+         hits++;
+         if (write)
+         {
+            dirty[index] = true;
+         }
+         touch(set, way);
+         return true;
+      }
+   }
+
+   misses++;
+   uint64_t way = victim(set);
+   uint64_t index = set * ways + way;
+   if (valid[index])
+   {
+      evictions++;
+      if (dirty[index])
+      {
+         writebacks++;
+         evicted = true;
+         evicted_address = (tags[index] * sets + set) << line_shift;
+      }
+   }
+   tags[index] = tag;
+   valid[index] = true;
+   dirty[index] = write;
+   touch(set, way);
+   return false;
+}
+
+void cache::print_statistics()
+{
+   cout << name << " cache: " << dec << accesses << " accesses, " << hits << " hits, " << misses << " misses";
+   if (accesses != 0)
+   {
+      cout << " (" << fixed << setprecision(2) << 100.0 * misses / accesses << "% miss rate)";
+   }
+   cout << ", " << evictions << " evictions, " << writebacks << " writebacks" << endl;
+}
+
+cache_hierarchy::cache_hierarchy()
+{
+   l1i = NULL;
+   l1d = NULL;
+   l2 = NULL;
+   memory_latency = 100;
+}
+
+// Parse a size with an optional k or m suffix
+static bool parse_size(string text, uint64_t &size)
+{
+   char *end;
+   size = strtoull(text.c_str(), &end, 10);
+   if (end == text.c_str())
+   {
+      return false;
+   }
+   string suffix(end);
+   if (suffix == "k" || suffix == "K")
+   {
+      size *= 1024;
+   }
+   else if (suffix == "m" || suffix == "M")
+   {
+      size *= 1024 * 1024;
+   }
+   else if (suffix != "")
+   {
+      return false;
+   }
+   return true;
+}
+
+static bool is_power_of_two(uint64_t value)
+{
+   return value != 0 && (value & (value - 1)) == 0;
+}
+
+bool cache_hierarchy::configure(string setting)
+{
+   size_t equals = setting.find('=');
+   if (equals == string::npos)
+   {
+      cout << "Invalid cache setting: " << setting << endl;
+      return false;
+   }
+   string level = setting.substr(0, equals);
+   if (level == "memory")
+   {
+      if (!parse_size(setting.substr(equals + 1), memory_latency))
+      {
+         cout << "Invalid memory latency: " << setting << endl;
+         return false;
+      }
+      return true;
+   }
+   if (level != "l1i" && level != "l1d" && level != "l2")
+   {
+      cout << "Unknown cache: " << level << endl;
+      return false;
+   }
+
+   vector<string> fields;
+   stringstream parameters(setting.substr(equals + 1));
+   string field;
+   while (getline(parameters, field, ':'))
+   {
+      fields.push_back(field);
+   }
+   uint64_t size, line_size, ways;
+   uint64_t latency = (level == "l2") ? 10 : 0;
+   replacement_policy policy = rp_lru;
+   if (fields.size() < 3 || fields.size() > 5 || !parse_size(fields[0], size) || !parse_size(fields[1], line_size) ||
+       !parse_size(fields[2], ways) || (fields.size() == 5 && !parse_size(fields[4], latency)))
+   {
+      cout << "Invalid cache setting: " << setting << endl;
+      return false;
+   }
+   if (fields.size() >= 4)
+   {
+      if (fields[3] == "lru")
+      {
+         policy = rp_lru;
+      }
+      else if (fields[3] == "plru")
+      {
+         policy = rp_plru;
+      }
+      else if (fields[3] == "random")
+      {
+         policy = rp_random;
+      }
+      else
+      {
+         cout << "Unknown replacement policy: " << fields[3] << endl;
+         return false;
+      }
+   }
+   if (!is_power_of_two(line_size) || !is_power_of_two(ways) || ways > 32 || size < line_size * ways ||
+       !is_power_of_two(size / (line_size * ways)))
+   {
+      cout << "Invalid cache geometry: " << setting << endl;
+      return false;
+   }
+
+   string name = level == "l1i" ? "L1I" : (level == "l1d" ? "L1D" : "L2");
+   cache *model = new cache(name, size, line_size, ways, policy, latency);
+   cache *&slot = level == "l1i" ? l1i : (level == "l1d" ? l1d : l2);
+   delete slot;
+   slot = model;
+   return true;
+}
+
+uint64_t cache_hierarchy::access(cache *l1, uint64_t address, bool write)
+{
+   if (l1 == NULL)
+   {
+      return 0;
+   }
+   bool evicted;
+   uint64_t evicted_address;
+   if (l1->access(address, write, evicted, evicted_address))
+   {
+      return l1->latency;
+   }
+   // The write back of a dirty line is buffered and does not delay the access
+   if (evicted)
+   {
+      access_l2(evicted_address, true);
+   }
+   return l1->latency + access_l2(address, false);
+}
+
+uint64_t cache_hierarchy::access_l2(uint64_t address, bool write)
+{
+   if (l2 == NULL)
+   {
+      return memory_latency;
+   }
+   bool evicted;
+   uint64_t evicted_address;
+   if (l2->access(address, write, evicted, evicted_address))
+   {
+      return l2->latency;
+   }
+   return l2->latency + memory_latency;
+}
+
+void cache_hierarchy::print_statistics()
+{
+   cache *levels[3] = {l1i, l1d, l2};
+   for (unsigned int i = 0; i < 3; i++)
+   {
+      if (levels[i] != NULL)
+      {
+         levels[i]->print_statistics();
+      }
+   }
+}
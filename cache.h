@@ -0,0 +1,112 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Classes for the cache hierarchy model
+
+**************************************************************** */
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+enum replacement_policy
+{
+   rp_lru,
+   rp_plru,
+   rp_random
+};
+
+// A set-associative, write-back, write-allocate cache. Only tags are kept; the data stays
+// in memory.
+class cache
+{
+
+private:
+   string name;
+   uint64_t line_size;
+   uint64_t ways;
+   uint64_t sets;
+   replacement_policy policy;
+   unsigned int line_shift;
+
+   // Per line, indexed by set * ways + way
+   vector<uint64_t> tags;
+   vector<bool> valid;
+   vector<bool> dirty;
+   vector<uint64_t> last_used; // for LRU
+   // Per set, the tree bits for PLRU
+   vector<uint64_t> plru_bits;
+   uint64_t access_stamp;
+   uint64_t random_state;
+
+   void touch(uint64_t set, uint64_t way);
+   uint64_t victim(uint64_t set);
+
+public:
+   // Extra cycles for an access that hits in this cache
+   uint64_t latency;
+
+   uint64_t accesses;
+   uint64_t hits;
+   uint64_t misses;
+   uint64_t evictions;
+   uint64_t writebacks;
+
+   // Constructor
+   cache(string name, uint64_t size, uint64_t line_size, uint64_t ways, replacement_policy policy, uint64_t latency);
+
+   // Look up the line holding address, allocating it on a miss. Return true on a hit.
+   // On a miss, evicted is set if a dirty line was replaced, with its address in evicted_address.
+   bool access(uint64_t address, bool write, bool &evicted, uint64_t &evicted_address);
+
+   void print_statistics();
+};
+
+// Optional split L1 caches and unified L2 cache, in front of main memory
+class cache_hierarchy
+{
+
+private:
+   cache *l1i;
+   cache *l1d;
+   cache *l2;
+   uint64_t memory_latency;
+
+   uint64_t access(cache *l1, uint64_t address, bool write);
+   uint64_t access_l2(uint64_t address, bool write);
+
+public:
+   // Constructor
+   cache_hierarchy();
+
+   // Configure from a setting of the form level=size:line:ways[:policy[:latency]], where level
+   // is l1i, l1d or l2, or memory=latency. Print a message and return false if the setting is invalid.
+   bool configure(string setting);
+
+   // Account for an instruction fetch, load or store. Return the extra cycles it takes.
+   // Without an L1 cache for the kind of access, it is not modelled and takes none.
+   uint64_t fetch(uint64_t address)
+   {
+      return access(l1i, address, false);
+   }
+
+   uint64_t load(uint64_t address)
+   {
+      return access(l1d, address, false);
+   }
+
+   uint64_t store(uint64_t address)
+   {
+      return access(l1d, address, true);
+   }
+
+   void print_statistics();
+};
+
+#endif
@@ -0,0 +1,111 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Checkpoint files of the complete simulator state
+
+**************************************************************** */
+
+#include <iostream>
+#include <stdio.h>
+
+#include "checkpoint.h"
+#include "memory.h"
+#include "processor.h"
+
+using namespace std;
+
+static const char checkpoint_magic[8] = {'R', 'V', '6', '4', 'C', 'K', 'P', '2'};
+
+bool save_checkpoint(string file_name, memory *main_memory, const vector<processor *> &harts)
+{
+   vector<uint8_t> data(checkpoint_magic, checkpoint_magic + 8);
+   checkpoint_put(data, harts.size());
+   for (size_t id = 0; id < harts.size(); id++)
+   {
+      vector<uint8_t> state;
+      harts[id]->save_state(state);
+      checkpoint_put(data, state.size());
+      data.insert(data.end(), state.begin(), state.end());
+   }
+   main_memory->save_pages(data);
+
+   FILE *file = fopen(file_name.c_str(), "wb");
+   if (file == NULL)
+   {
+      cout << "Cannot create checkpoint file " << file_name << endl;
+      return false;
+   }
+   bool written = fwrite(data.data(), 1, data.size(), file) == data.size();
+   written = fclose(file) == 0 && written;
+   if (!written)
+   {
+      cout << "Failed to write checkpoint file " << file_name << endl;
+   }
+   return written;
+}
+
+bool restore_checkpoint(string file_name, memory *main_memory, const vector<processor *> &harts)
+{
+   // Read the whole file in one go, then check every part before changing any state
+   FILE *file = fopen(file_name.c_str(), "rb");
+   if (file == NULL)
+   {
+      cout << "Cannot open checkpoint file " << file_name << endl;
+      return false;
+   }
+   fseek(file, 0, SEEK_END);
+   long length = ftell(file);
+   fseek(file, 0, SEEK_SET);
+   vector<uint8_t> data(length > 0 ? length : 0);
+   bool read = length > 0 && fread(data.data(), 1, data.size(), file) == data.size();
+   fclose(file);
+
+   const uint8_t *in = data.data();
+   const uint8_t *end = in + data.size();
+   uint64_t hart_count = 0;
+   bool valid = read && data.size() >= 8 && memcmp(in, checkpoint_magic, 8) == 0 &&
+                checkpoint_get(in += 8, end, hart_count);
+   // Locate the state of each hart
+   vector<const uint8_t *> states;
+   vector<uint64_t> state_lengths;
+   for (uint64_t id = 0; valid && id < hart_count; id++)
+   {
+      uint64_t state_length;
+      valid = checkpoint_get(in, end, state_length) && state_length <= (uint64_t)(end - in);
+      if (valid)
+      {
+         states.push_back(in);
+         state_lengths.push_back(state_length);
+         in += state_length;
+      }
+   }
+   if (!valid)
+   {
+      cout << file_name << " is not a checkpoint file" << endl;
+      return false;
+   }
+   if (hart_count != harts.size())
+   {
+      cout << "Checkpoint file " << file_name << " is for " << dec << hart_count << " harts, not " << harts.size()
+           << endl;
+      return false;
+   }
+   const uint8_t *pages = in;
+   bool intact = main_memory->restore_pages(pages, end - pages, false);
+   for (size_t id = 0; id < harts.size(); id++)
+   {
+      intact = intact && harts[id]->restore_state(states[id], state_lengths[id], false);
+   }
+   if (!intact)
+   {
+      cout << "Checkpoint file " << file_name << " is corrupt" << endl;
+      return false;
+   }
+   main_memory->restore_pages(pages, end - pages, true);
+   for (size_t id = 0; id < harts.size(); id++)
+   {
+      harts[id]->restore_state(states[id], state_lengths[id], true);
+   }
+   return true;
+}
@@ -0,0 +1,53 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Checkpoint files of the complete simulator state
+
+**************************************************************** */
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class memory;
+class processor;
+
+// A checkpoint file holds the magic "RV64CKP2", the number of harts, the length and contents
+// of the state of each hart, then the memory pages. Numbers are 64-bit little-endian.
+
+// Write the state of the harts and memory to a file. Print a message and return false on failure.
+bool save_checkpoint(string file_name, memory *main_memory, const vector<processor *> &harts);
+
+// Replace the state of the harts and memory with the state in a file. Print a message and return
+// false if the file cannot be read, is not a valid checkpoint or is for a different number of
+// harts, leaving the state unchanged.
+bool restore_checkpoint(string file_name, memory *main_memory, const vector<processor *> &harts);
+
+// Append a number to checkpoint data
+inline void checkpoint_put(vector<uint8_t> &out, uint64_t value)
+{
+   uint8_t bytes[8];
+   memcpy(bytes, &value, 8);
+   out.insert(out.end(), bytes, bytes + 8);
+}
+
+// Read a number from checkpoint data, advancing in. Return false at the end of the data.
+inline bool checkpoint_get(const uint8_t *&in, const uint8_t *end, uint64_t &value)
+{
+   if (end - in < 8)
+   {
+      return false;
+   }
+   memcpy(&value, in, 8);
+   in += 8;
+   return true;
+}
+
+#endif
@@ -0,0 +1,107 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class for the core-local interruptor (CLINT)
+
+**************************************************************** */
+
+#include "clint.h"
+#include "processor.h"
+
+// Offsets of the registers from the base
+static const uint64_t msip_offset = 0x0000;
+static const uint64_t mtimecmp_offset = 0x4000;
+static const uint64_t mtime_offset_address = 0xbff8;
+
+clint::clint()
+{
+   mtime_offset = 0;
+   // No timer interrupt until a compare value is written
+   for (unsigned int i = 0; i < memory::max_ports; i++)
+   {
+      mtimecmp[i] = ~(uint64_t)0;
+      msip[i] = 0;
+   }
+}
+
+void clint::attach(processor *hart)
+{
+   harts.push_back(hart);
+   hart->set_clint(this);
+}
+
+void clint::changed(unsigned int hart)
+{
+   harts[hart]->timer_changed();
+}
+
+// The doubleword of registers at an offset, a multiple of 8
+uint64_t clint::doubleword(uint64_t offset, uint64_t now)
+{
+   if (offset - msip_offset < 4 * harts.size())
+   {
+      unsigned int hart = (offset - msip_offset) / 4;
+      uint64_t upper = hart + 1 < harts.size() ? msip[hart + 1].load(memory_order_relaxed) : 0;
+      return msip[hart].load(memory_order_relaxed) | upper << 32;
+   }
+   if (offset - mtimecmp_offset < 8 * harts.size())
+   {
+      return get_mtimecmp((offset - mtimecmp_offset) / 8);
+   }
+   if (offset == mtime_offset_address)
+   {
+      return get_mtime(now);
+   }
+   return 0;
+}
+
+uint64_t clint::read(uint64_t offset, unsigned int bytes, uint64_t now)
+{
+   return read_part(doubleword(offset & ~7ULL, now), offset, bytes);
+}
+
+void clint::write(uint64_t offset, unsigned int bytes, uint64_t value, uint64_t now)
+{
+   value = write_part(doubleword(offset & ~7ULL, now), offset, bytes, value);
+   offset &= ~7ULL;
+   if (offset - msip_offset < 4 * harts.size())
+   {
+      // Only bit 0 of each msip is implemented
+      unsigned int first = (offset - msip_offset) / 4;
+      for (unsigned int i = 0; i < 2 && first + i < harts.size(); i++)
+      {
+         msip[first + i] = (value >> (32 * i)) & 1;
+         changed(first + i);
+      }
+   }
+   else if (offset - mtimecmp_offset < 8 * harts.size())
+   {
+      unsigned int hart = (offset - mtimecmp_offset) / 8;
+      mtimecmp[hart] = value;
+      changed(hart);
+   }
+   else if (offset == mtime_offset_address)
+   {
+      mtime_offset = value - now;
+      for (unsigned int hart = 0; hart < harts.size(); hart++)
+      {
+         changed(hart);
+      }
+   }
+}
+
+void clint::get_state(unsigned int hart, uint64_t state[3])
+{
+   state[0] = mtime_offset;
+   state[1] = mtimecmp[hart];
+   state[2] = msip[hart];
+}
+
+void clint::set_state(unsigned int hart, const uint64_t state[3])
+{
+   mtime_offset = state[0];
+   mtimecmp[hart] = state[1];
+   msip[hart] = state[2] & 1;
+   changed(hart);
+}
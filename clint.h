@@ -0,0 +1,67 @@
+#ifndef CLINT_H
+#define CLINT_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class for the core-local interruptor (CLINT)
+
+**************************************************************** */
+
+#include <stdint.h>
+#include <vector>
+#include <atomic>
+
+#include "memory.h"
+#include "device.h"
+
+using namespace std;
+
+class processor;
+
+// The machine timer and software interrupts, memory-mapped in the layout of the SiFive CLINT:
+// msip for each hart at offset 4 * hart, mtimecmp for each hart at 0x4000 + 8 * hart, and
+// mtime at 0xbff8. Time advances by one tick per instruction retired, as counted by each hart,
+// so a hart sees mtime as its own instruction count plus an offset set by writing mtime. The
+// harts are told when a register that affects them is written, and otherwise only look at the
+// timer when their count reaches the deadline they computed from it.
+class clint : public device
+{
+
+private:
+   vector<processor *> harts;
+   atomic<uint64_t> mtime_offset;
+   atomic<uint64_t> mtimecmp[memory::max_ports];
+   atomic<uint32_t> msip[memory::max_ports];
+
+   void changed(unsigned int hart);
+   uint64_t doubleword(uint64_t offset, uint64_t now);
+
+public:
+   // Address of the registers in memory, and the length of the range they occupy
+   static const uint64_t default_base = 0x2000000;
+   static const uint64_t size = 0x10000;
+
+   // Constructor
+   clint();
+
+   // Connect the next hart, in order of hart ID
+   void attach(processor *hart);
+
+   // Read or write the register bytes at an offset. Bytes with no register read as zero and
+   // ignore writes.
+   uint64_t read(uint64_t offset, unsigned int bytes, uint64_t now);
+   void write(uint64_t offset, unsigned int bytes, uint64_t value, uint64_t now);
+
+   // The time a hart sees when its instruction count is now
+   uint64_t get_mtime(uint64_t now) { return now + mtime_offset.load(memory_order_relaxed); }
+   uint64_t get_mtimecmp(unsigned int hart) { return mtimecmp[hart].load(memory_order_relaxed); }
+   bool get_msip(unsigned int hart) { return msip[hart].load(memory_order_relaxed) != 0; }
+
+   // The state for a hart, which is saved with it: the mtime offset, its mtimecmp and its msip
+   void get_state(unsigned int hart, uint64_t state[3]);
+   void set_state(unsigned int hart, const uint64_t state[3]);
+};
+
+#endif
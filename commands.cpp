@@ -15,7 +15,9 @@
 
 #include "memory.h"
 #include "processor.h"
+#include "harts.h"
 #include "commands.h"
+#include "checkpoint.h"
 
 using namespace std;
 
@@ -139,10 +141,11 @@ bool command_match_b(string& command, unsigned int i, bool& address_present, uin
 }
 
 
-bool command_match_l(string& command, unsigned int i, string& filename) {
+// Match a command word followed by a quoted file name
+bool command_match_file_command(string& command, unsigned int i, const string& word, string& filename) {
   unsigned int j;
-  if (i == command.length() || command[i] != 'l') return false;
-  i++;
+  if (command.compare(i, word.length(), word) != 0) return false;
+  i += word.length();
   if (!command_skip_required_whitespace(command, i)) return false;
   if (i == command.length() || command[i] != '"') return false;
   i++;
@@ -157,6 +160,11 @@ bool command_match_l(string& command, unsigned int i, string& filename) {
 }
 
 
+bool command_match_l(string& command, unsigned int i, string& filename) {
+  return command_match_file_command(command, i, "l", filename);
+}
+
+
 bool command_match_prv(string& command, unsigned int i, bool& num_present, unsigned int& num) {
   num_present = false;
   if (i == command.length() || command[i] != 'p') return false;
@@ -199,8 +207,41 @@ bool command_match_csr(string& command, unsigned int i, bool& data_present, uint
 }
 
 
-// Command interpreter function
-void interpret_commands(memory* main_memory, processor* cpu, bool verbose) {
+bool command_match_save(string& command, unsigned int i, string& filename) {
+  return command_match_file_command(command, i, "save", filename);
+}
+
+
+bool command_match_restore(string& command, unsigned int i, string& filename) {
+  return command_match_file_command(command, i, "restore", filename);
+}
+
+
+bool command_match_word(string& command, unsigned int i, const string& word) {
+  if (command.compare(i, word.length(), word) != 0) return false;
+  i += word.length();
+  command_skip_optional_whitespace(command, i);
+  return i == command.length() || command[i] == '#';
+}
+
+
+bool command_match_hart(string& command, unsigned int i, bool& num_present, unsigned int& num) {
+  num_present = false;
+  if (command.compare(i, 4, "hart") != 0) return false;
+  i += 4;
+  if (i == command.length() || command[i] == '#') return true;
+  if (!command_skip_required_whitespace(command, i)) return false;
+  if (command_match_decimal_number(command, i, num)) {
+    num_present = true;
+    command_skip_optional_whitespace(command, i);
+  }
+  return i == command.length() || command[i] == '#';
+}
+
+
+// Command interpreter function. Commands apply to the current hart, except . which runs
+// every hart, and l, which starts every hart at the entry point.
+void interpret_commands(memory* main_memory, hart_scheduler* harts, bool verbose) {
 
   string command;
   unsigned int i;
@@ -208,6 +249,9 @@ void interpret_commands(memory* main_memory, processor* cpu, bool verbose) {
   uint64_t address, data;
   unsigned int num;
   string filename;
+  vector<vector<uint8_t> > snapshot_states;  // Hart states at the memory snapshot
+  unsigned int current = 0;  // Current hart
+  processor* cpu = harts->get_hart(current);
 
   while (true) {
     getline(cin, command);  // Read the next line of input
@@ -247,10 +291,10 @@ void interpret_commands(memory* main_memory, processor* cpu, bool verbose) {
     }
     else if (command_match_dot(command, i, num_present, num)) {  // Check for . command
       if (!num_present) {  // No instruction count value
-        cpu->execute(1, false);  // so just execute one instruction without breakpoint check
+        harts->execute(1, false);  // so just execute one instruction without breakpoint check
       }
       else {
-        cpu->execute(num, true);  // Execute specified number of instructions with breakpoint check
+        harts->execute(num, true);  // Execute specified number of instructions with breakpoint check
       }
     }
     else if (command_match_b(command, i, address_present, address)) {  // Check for b command
@@ -264,13 +308,47 @@ void interpret_commands(memory* main_memory, processor* cpu, bool verbose) {
     else if (command_match_l(command, i, filename)) {  // Check for l command
       uint64_t start_address;
       if (main_memory->load_file(filename, start_address)) {  // Load using the specified file name
-        cpu->set_pc(start_address);
+        for (unsigned int id = 0; id < harts->get_hart_count(); id++)
+          harts->get_hart(id)->set_pc(start_address);
+      }
+    }
+    else if (command_match_save(command, i, filename)) {  // Check for save command
+      save_checkpoint(filename, main_memory, harts->get_harts());
+    }
+    else if (command_match_restore(command, i, filename)) {  // Check for restore command
+      restore_checkpoint(filename, main_memory, harts->get_harts());
+    }
+    else if (command_match_word(command, i, "snapshot")) {  // Check for snapshot command
+      main_memory->take_snapshot();
+      snapshot_states.assign(harts->get_hart_count(), vector<uint8_t>());
+      for (unsigned int id = 0; id < harts->get_hart_count(); id++)
+        harts->get_hart(id)->save_state(snapshot_states[id]);
+    }
+    else if (command_match_word(command, i, "revert")) {  // Check for revert command
+      if (main_memory->revert_to_snapshot()) {
+        for (unsigned int id = 0; id < harts->get_hart_count(); id++)
+          harts->get_hart(id)->restore_state(snapshot_states[id].data(), snapshot_states[id].size(), true);
+      }
+      else {
+        cout << "No snapshot to revert to" << endl;
+      }
+    }
+    else if (command_match_hart(command, i, num_present, num)) {  // Check for hart command
+      if (!num_present) {  // No hart number
+        cout << dec << current << endl;  // so just show the current hart
+      }
+      else if (num >= harts->get_hart_count()) {
+        cout << "Incorrect hart number" << endl;
+      }
+      else {
+        current = num;  // Select the current hart
+        cpu = harts->get_hart(current);
       }
     }
     else if (command_match_prv(command, i, num_present, num)) {  // Check for prv command
       if (!num_present) { // No new privilege level
         cpu->show_prv();  // so just show current privilege level
-      } else if (num == 0 || num == 3) {
+      } else if (num == 0 || num == 1 || num == 3) {
         cpu->set_prv(num);  // Set the current privilege level
       } else {
         cout << "Incorrect privilege level" << endl;
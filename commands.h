@@ -11,7 +11,8 @@
 
 #include "memory.h"
 #include "processor.h"
+#include "harts.h"
 
-void interpret_commands(memory* main_memory, processor* cpu, bool verbose);
+void interpret_commands(memory* main_memory, hart_scheduler* harts, bool verbose);
 
 #endif
@@ -0,0 +1,212 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Expansion of RV64C compressed instructions
+
+**************************************************************** */
+
+#include "compressed.h"
+
+// Opcodes of the 32-bit instructions that compressed instructions expand to
+static const uint32_t opcode_load = 0x03;
+static const uint32_t opcode_op_imm = 0x13;
+static const uint32_t opcode_op_imm_32 = 0x1b;
+static const uint32_t opcode_store = 0x23;
+static const uint32_t opcode_op = 0x33;
+static const uint32_t opcode_lui = 0x37;
+static const uint32_t opcode_op_32 = 0x3b;
+static const uint32_t opcode_branch = 0x63;
+static const uint32_t opcode_jalr = 0x67;
+static const uint32_t opcode_jal = 0x6f;
+
+// Bits first..first+count-1 of an instruction, moved to bit position
+static inline uint32_t bits(uint32_t instruction, unsigned int first, unsigned int count, unsigned int position)
+{
+   return ((instruction >> first) & ((1U << count) - 1)) << position;
+}
+
+// Sign-extend the low width bits of value
+static inline int32_t sign_extend(uint32_t value, unsigned int width)
+{
+   return (int32_t)(value << (32 - width)) >> (32 - width);
+}
+
+static inline uint32_t i_type(int32_t imm, uint32_t rs1, uint32_t funct3, uint32_t rd, uint32_t opcode)
+{
+   return ((uint32_t)imm & 0xFFF) << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode;
+}
+
+static inline uint32_t s_type(int32_t imm, uint32_t rs2, uint32_t rs1, uint32_t funct3)
+{
+   return (((uint32_t)imm >> 5) & 0x7F) << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | ((uint32_t)imm & 0x1F) << 7 |
+          opcode_store;
+}
+
+static inline uint32_t r_type(uint32_t funct7, uint32_t rs2, uint32_t rs1, uint32_t funct3, uint32_t rd, uint32_t opcode)
+{
+   return funct7 << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode;
+}
+
+static inline uint32_t b_type(int32_t imm, uint32_t rs1, uint32_t funct3)
+{
+   uint32_t offset = imm;
+   return bits(offset, 12, 1, 31) | bits(offset, 5, 6, 25) | rs1 << 15 | funct3 << 12 | bits(offset, 1, 4, 8) |
+          bits(offset, 11, 1, 7) | opcode_branch;
+}
+
+static inline uint32_t j_type(int32_t imm, uint32_t rd)
+{
+   uint32_t offset = imm;
+   return bits(offset, 20, 1, 31) | bits(offset, 1, 10, 21) | bits(offset, 11, 1, 20) | bits(offset, 12, 8, 12) |
+          rd << 7 | opcode_jal;
+}
+
+// Quadrant 0: loads and stores relative to x8-x15, and ADDI4SPN
+static uint32_t expand_quadrant_0(uint32_t c, uint32_t funct3)
+{
+   // rd' and rs1' select x8-x15
+   uint32_t rd = 8 + bits(c, 2, 3, 0);
+   uint32_t rs1 = 8 + bits(c, 7, 3, 0);
+   uint32_t word_offset = bits(c, 10, 3, 3) | bits(c, 6, 1, 2) | bits(c, 5, 1, 6);
+   uint32_t doubleword_offset = bits(c, 10, 3, 3) | bits(c, 5, 2, 6);
+   switch (funct3)
+   {
+   case 0x0: // C.ADDI4SPN
+   {
+      uint32_t imm = bits(c, 11, 2, 4) | bits(c, 7, 4, 6) | bits(c, 6, 1, 2) | bits(c, 5, 1, 3);
+      return imm == 0 ? 0 : i_type(imm, 2, 0x0, rd, opcode_op_imm);
+   }
+   case 0x2: // C.LW
+      return i_type(word_offset, rs1, 0x2, rd, opcode_load);
+   case 0x3: // C.LD
+      return i_type(doubleword_offset, rs1, 0x3, rd, opcode_load);
+   case 0x6: // C.SW
+      return s_type(word_offset, rd, rs1, 0x2);
+   case 0x7: // C.SD
+      return s_type(doubleword_offset, rd, rs1, 0x3);
+   default: // C.FLD, C.FSD and reserved
+      return 0;
+   }
+}
+
+// Quadrant 1: immediates, arithmetic on x8-x15, jumps and branches
+static uint32_t expand_quadrant_1(uint32_t c, uint32_t funct3)
+{
+   uint32_t rd = bits(c, 7, 5, 0);
+   int32_t imm = sign_extend(bits(c, 12, 1, 5) | bits(c, 2, 5, 0), 6);
+   uint32_t rd_short = 8 + bits(c, 7, 3, 0);
+   uint32_t rs2_short = 8 + bits(c, 2, 3, 0);
+   switch (funct3)
+   {
+   case 0x0: // C.ADDI (C.NOP for rd 0)
+      return i_type(imm, rd, 0x0, rd, opcode_op_imm);
+   case 0x1: // C.ADDIW
+      return rd == 0 ? 0 : i_type(imm, rd, 0x0, rd, opcode_op_imm_32);
+   case 0x2: // C.LI
+      return i_type(imm, 0, 0x0, rd, opcode_op_imm);
+   case 0x3:
+      if (rd == 2) // C.ADDI16SP
+      {
+         int32_t offset = sign_extend(bits(c, 12, 1, 9) | bits(c, 6, 1, 4) | bits(c, 5, 1, 6) | bits(c, 3, 2, 7) |
+                                      bits(c, 2, 1, 5), 10);
+         return offset == 0 ? 0 : i_type(offset, 2, 0x0, 2, opcode_op_imm);
+      }
+      // C.LUI
+      return imm == 0 ? 0 : ((uint32_t)imm << 12) | rd << 7 | opcode_lui;
+   case 0x4:
+      switch (bits(c, 10, 2, 0))
+      {
+      case 0x0: // C.SRLI
+         return i_type(bits(c, 12, 1, 5) | bits(c, 2, 5, 0), rd_short, 0x5, rd_short, opcode_op_imm);
+      case 0x1: // C.SRAI
+         return i_type(0x400 | bits(c, 12, 1, 5) | bits(c, 2, 5, 0), rd_short, 0x5, rd_short, opcode_op_imm);
+      case 0x2: // C.ANDI
+         return i_type(imm, rd_short, 0x7, rd_short, opcode_op_imm);
+      default:
+      {
+         // C.SUB, C.XOR, C.OR and C.AND, then C.SUBW and C.ADDW
+         static const uint32_t funct3s[4] = {0x0, 0x4, 0x6, 0x7};
+         static const uint32_t funct7s[4] = {0x20, 0, 0, 0};
+         uint32_t operation = bits(c, 5, 2, 0);
+         if (bits(c, 12, 1, 0) == 0)
+         {
+            return r_type(funct7s[operation], rs2_short, rd_short, funct3s[operation], rd_short, opcode_op);
+         }
+         if (operation >= 2)
+         {
+            return 0;
+         }
+         return r_type(funct7s[operation], rs2_short, rd_short, 0x0, rd_short, opcode_op_32);
+      }
+      }
+   case 0x5: // C.J
+   {
+      int32_t offset = sign_extend(bits(c, 12, 1, 11) | bits(c, 11, 1, 4) | bits(c, 9, 2, 8) | bits(c, 8, 1, 10) |
+                                   bits(c, 7, 1, 6) | bits(c, 6, 1, 7) | bits(c, 3, 3, 1) | bits(c, 2, 1, 5), 12);
+      return j_type(offset, 0);
+   }
+   default: // C.BEQZ and C.BNEZ
+   {
+      int32_t offset = sign_extend(bits(c, 12, 1, 8) | bits(c, 10, 2, 3) | bits(c, 5, 2, 6) | bits(c, 3, 2, 1) |
+                                   bits(c, 2, 1, 5), 9);
+      return b_type(offset, rd_short, funct3 == 0x6 ? 0x0 : 0x1);
+   }
+   }
+}
+
+// Quadrant 2: shifts, stack-relative loads and stores, moves, jumps through registers and EBREAK
+static uint32_t expand_quadrant_2(uint32_t c, uint32_t funct3)
+{
+   uint32_t rd = bits(c, 7, 5, 0);
+   uint32_t rs2 = bits(c, 2, 5, 0);
+   switch (funct3)
+   {
+   case 0x0: // C.SLLI
+      return i_type(bits(c, 12, 1, 5) | bits(c, 2, 5, 0), rd, 0x1, rd, opcode_op_imm);
+   case 0x2: // C.LWSP
+      return rd == 0 ? 0 : i_type(bits(c, 12, 1, 5) | bits(c, 4, 3, 2) | bits(c, 2, 2, 6), 2, 0x2, rd, opcode_load);
+   case 0x3: // C.LDSP
+      return rd == 0 ? 0 : i_type(bits(c, 12, 1, 5) | bits(c, 5, 2, 3) | bits(c, 2, 3, 6), 2, 0x3, rd, opcode_load);
+   case 0x4:
+      if (bits(c, 12, 1, 0) == 0)
+      {
+         if (rs2 == 0) // C.JR
+         {
+            return rd == 0 ? 0 : i_type(0, rd, 0x0, 0, opcode_jalr);
+         }
+         return r_type(0, rs2, 0, 0x0, rd, opcode_op); // C.MV
+      }
+      if (rs2 == 0)
+      {
+         if (rd == 0) // C.EBREAK
+         {
+            return 0x00100073;
+         }
+         return i_type(0, rd, 0x0, 1, opcode_jalr); // C.JALR
+      }
+      return r_type(0, rs2, rd, 0x0, rd, opcode_op); // C.ADD
+   case 0x6: // C.SWSP
+      return s_type(bits(c, 9, 4, 2) | bits(c, 7, 2, 6), rs2, 2, 0x2);
+   case 0x7: // C.SDSP
+      return s_type(bits(c, 10, 3, 3) | bits(c, 7, 3, 6), rs2, 2, 0x3);
+   default: // C.FLDSP and C.FSDSP
+      return 0;
+   }
+}
+
+uint32_t expand_compressed(uint16_t instruction)
+{
+   uint32_t funct3 = instruction >> 13;
+   switch (instruction & 3)
+   {
+   case 0:
+      return expand_quadrant_0(instruction, funct3);
+   case 1:
+      return expand_quadrant_1(instruction, funct3);
+   case 2:
+      return expand_quadrant_2(instruction, funct3);
+   default:
+      return 0;
+   }
+}
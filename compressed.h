@@ -0,0 +1,19 @@
+#ifndef COMPRESSED_H
+#define COMPRESSED_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Expansion of RV64C compressed instructions
+
+**************************************************************** */
+
+#include <stdint.h>
+
+// Return the 32-bit instruction a 16-bit compressed instruction expands to, or 0 (never a
+// valid instruction) if it is reserved or needs an extension that is not implemented, such as
+// the floating-point loads and stores.
+uint32_t expand_compressed(uint16_t instruction);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Base class for memory-mapped devices
+
+**************************************************************** */
+
+#include <stdint.h>
+
+using namespace std;
+
+// A device that claims a range of physical addresses, registered with memory::add_device.
+// Loads and stores to the range are passed to it instead of memory. Each access is naturally
+// aligned and of 1, 2, 4 or 8 bytes, at an offset from the start of the range, and is made by
+// a hart whose instruction count is now.
+class device
+{
+
+protected:
+   // The bytes of a doubleword of registers read by an access at an offset
+   static uint64_t read_part(uint64_t doubleword, uint64_t offset, unsigned int bytes)
+   {
+      return bytes < 8 ? (doubleword >> (8 * (offset % 8))) & ((1ULL << (8 * bytes)) - 1) : doubleword;
+   }
+
+   // A doubleword of registers with the bytes written by an access at an offset replaced
+   static uint64_t write_part(uint64_t doubleword, uint64_t offset, unsigned int bytes, uint64_t value)
+   {
+      if (bytes == 8)
+      {
+         return value;
+      }
+      uint64_t mask = ((1ULL << (8 * bytes)) - 1) << (8 * (offset % 8));
+      return (doubleword & ~mask) | ((value << (8 * (offset % 8))) & mask);
+   }
+
+public:
+   virtual ~device() {}
+
+   // Read or write the register bytes at an offset
+   virtual uint64_t read(uint64_t offset, unsigned int bytes, uint64_t now) = 0;
+   virtual void write(uint64_t offset, unsigned int bytes, uint64_t value, uint64_t now) = 0;
+};
+
+#endif
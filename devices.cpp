@@ -0,0 +1,268 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Classes for the UART, test finisher and block device
+
+**************************************************************** */
+
+#include <iostream>
+#include <iomanip>
+
+#include "devices.h"
+
+// Register indexes of the UART
+static const unsigned int uart_data = 0;     // Receive and transmit, or divisor low byte
+static const unsigned int uart_ier = 1;      // Interrupt enable, or divisor high byte
+static const unsigned int uart_iir_fcr = 2;  // Interrupt identification (read), FIFO control (write)
+static const unsigned int uart_lcr = 3;
+static const unsigned int uart_mcr = 4;
+static const unsigned int uart_lsr = 5;
+static const unsigned int uart_msr = 6;
+static const unsigned int uart_scr = 7;
+
+// Line control bit selecting the divisor latch at indexes 0 and 1
+static const uint8_t lcr_dlab = 0x80;
+
+uart::uart()
+{
+   divisor[0] = 1;
+   divisor[1] = 0;
+   ier = 0;
+   fcr = 0;
+   lcr = 0;
+   mcr = 0;
+   scr = 0;
+}
+
+uint8_t uart::read_register(unsigned int index)
+{
+   switch (index)
+   {
+   case uart_data:
+      return lcr & lcr_dlab ? divisor[0] : 0;
+   case uart_ier:
+      return lcr & lcr_dlab ? divisor[1] : ier;
+   case uart_iir_fcr:
+      // No interrupt pending, with the FIFOs shown enabled if they are
+      return fcr & 1 ? 0xc1 : 0x01;
+   case uart_lcr:
+      return lcr;
+   case uart_mcr:
+      return mcr;
+   case uart_lsr:
+      // Transmit holding register and transmitter empty
+      return 0x60;
+   case uart_msr:
+      // Clear to send, data set ready and carrier detect
+      return 0xb0;
+   case uart_scr:
+      return scr;
+   default:
+      return 0;
+   }
+}
+
+void uart::write_register(unsigned int index, uint8_t value)
+{
+   switch (index)
+   {
+   case uart_data:
+      if (lcr & lcr_dlab)
+      {
+         divisor[0] = value;
+      }
+      else
+      {
+         cout.put(value);
+      }
+      break;
+   case uart_ier:
+      if (lcr & lcr_dlab)
+      {
+         divisor[1] = value;
+      }
+      else
+      {
+         ier = value & 0x0f;
+      }
+      break;
+   case uart_iir_fcr:
+      fcr = value;
+      break;
+   case uart_lcr:
+      lcr = value;
+      break;
+   case uart_mcr:
+      mcr = value & 0x1f;
+      break;
+   case uart_scr:
+      scr = value;
+      break;
+   }
+}
+
+// An access of several bytes reaches that many consecutive registers
+uint64_t uart::read(uint64_t offset, unsigned int bytes, uint64_t now)
+{
+   uint64_t value = 0;
+   for (unsigned int i = 0; i < bytes; i++)
+   {
+      value |= (uint64_t)read_register(offset + i) << (8 * i);
+   }
+   return value;
+}
+
+void uart::write(uint64_t offset, unsigned int bytes, uint64_t value, uint64_t now)
+{
+   for (unsigned int i = 0; i < bytes; i++)
+   {
+      write_register(offset + i, value >> (8 * i));
+   }
+}
+
+// Values written to the test finisher
+static const uint64_t finisher_fail = 0x3333;
+static const uint64_t finisher_pass = 0x5555;
+
+test_finisher::test_finisher(memory *main_memory)
+{
+   this->main_memory = main_memory;
+}
+
+uint64_t test_finisher::read(uint64_t offset, unsigned int bytes, uint64_t now)
+{
+   return 0;
+}
+
+void test_finisher::write(uint64_t offset, unsigned int bytes, uint64_t value, uint64_t now)
+{
+   if (offset != 0 || bytes < 4)
+   {
+      return;
+   }
+   if ((value & 0xffff) == finisher_pass)
+   {
+      cout << "Test finisher: pass" << endl;
+      main_memory->halt();
+   }
+   else if ((value & 0xffff) == finisher_fail)
+   {
+      cout << "Test finisher: fail with code " << dec << ((value >> 16) & 0xffff) << endl;
+      main_memory->halt();
+   }
+}
+
+block_device::block_device(memory *main_memory)
+{
+   this->main_memory = main_memory;
+   capacity = 0;
+   sector = 0;
+   address = 0;
+   count = 0;
+   status = 0;
+}
+
+bool block_device::open(string file_name)
+{
+   file.open(file_name, ios::in | ios::out | ios::binary);
+   if (!file.is_open())
+   {
+      return false;
+   }
+   file.seekg(0, ios::end);
+   capacity = (uint64_t)file.tellg() / sector_size;
+   return true;
+}
+
+// Copy the sectors of the transfer, a sector at a time. Return false if they are not all in
+// the file or it cannot be accessed.
+bool block_device::transfer(bool writing)
+{
+   if (count > capacity || sector > capacity - count)
+   {
+      return false;
+   }
+   uint8_t buffer[sector_size];
+   for (uint64_t i = 0; i < count; i++)
+   {
+      uint64_t position = (sector + i) * sector_size;
+      uint64_t data_address = address + i * sector_size;
+      if (writing)
+      {
+         main_memory->read_bytes(data_address, buffer, sector_size);
+         file.seekp(position);
+         file.write((const char *)buffer, sector_size);
+      }
+      else
+      {
+         file.seekg(position);
+         file.read((char *)buffer, sector_size);
+      }
+      if (!file)
+      {
+         file.clear();
+         return false;
+      }
+      if (!writing)
+      {
+         main_memory->write_bytes(data_address, buffer, sector_size);
+      }
+   }
+   if (writing)
+   {
+      file.flush();
+   }
+   return true;
+}
+
+uint64_t block_device::read(uint64_t offset, unsigned int bytes, uint64_t now)
+{
+   uint64_t doubleword = 0;
+   switch (offset & ~7ULL)
+   {
+   case sector_register:
+      doubleword = sector;
+      break;
+   case address_register:
+      doubleword = address;
+      break;
+   case count_register:
+      doubleword = count;
+      break;
+   case status_register:
+      doubleword = status;
+      break;
+   case capacity_register:
+      doubleword = capacity;
+      break;
+   }
+   return read_part(doubleword, offset, bytes);
+}
+
+void block_device::write(uint64_t offset, unsigned int bytes, uint64_t value, uint64_t now)
+{
+   switch (offset & ~7ULL)
+   {
+   case sector_register:
+      sector = write_part(sector, offset, bytes, value);
+      break;
+   case address_register:
+      address = write_part(address, offset, bytes, value);
+      break;
+   case count_register:
+      count = write_part(count, offset, bytes, value);
+      break;
+   case command_register:
+      value = write_part(0, offset, bytes, value);
+      if (value == 1 || value == 2)
+      {
+         status = transfer(value == 2) ? 0 : 1;
+      }
+      else
+      {
+         status = 1;
+      }
+      break;
+   }
+}
@@ -0,0 +1,118 @@
+#ifndef DEVICES_H
+#define DEVICES_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Classes for the UART, test finisher and block device
+
+**************************************************************** */
+
+#include <stdint.h>
+#include <string>
+#include <fstream>
+
+#include "memory.h"
+#include "device.h"
+
+using namespace std;
+
+// A 16550-compatible UART with byte-wide registers. Characters written to the transmit
+// register go to standard output, and the transmitter is always ready. There is no input,
+// so the receive register reads as zero and data is never ready. Interrupts are not raised.
+class uart : public device
+{
+
+private:
+   // Divisor latch, interrupt enable, FIFO control, line control, modem control and scratch
+   // registers, which hold what is written to them
+   uint8_t divisor[2];
+   uint8_t ier;
+   uint8_t fcr;
+   uint8_t lcr;
+   uint8_t mcr;
+   uint8_t scr;
+
+   uint8_t read_register(unsigned int index);
+   void write_register(unsigned int index, uint8_t value);
+
+public:
+   // Address of the registers in memory, and the length of the range they occupy
+   static const uint64_t default_base = 0x10000000;
+   static const uint64_t size = 0x100;
+
+   // Constructor
+   uart();
+
+   // Read or write the registers at an offset, one byte each
+   uint64_t read(uint64_t offset, unsigned int bytes, uint64_t now);
+   void write(uint64_t offset, unsigned int bytes, uint64_t value, uint64_t now);
+};
+
+// The SiFive test finisher. Writing a word whose low half is 0x5555 reports that the program
+// passed, and 0x3333 that it failed with the code in the upper half. Either halts every hart.
+class test_finisher : public device
+{
+
+private:
+   memory *main_memory;
+
+public:
+   // Address of the register in memory, and the length of the range it occupies
+   static const uint64_t default_base = 0x100000;
+   static const uint64_t size = 0x1000;
+
+   // Constructor, halting main_memory when finished
+   test_finisher(memory *main_memory);
+
+   // The register reads as zero
+   uint64_t read(uint64_t offset, unsigned int bytes, uint64_t now);
+   void write(uint64_t offset, unsigned int bytes, uint64_t value, uint64_t now);
+};
+
+// A block device backed by a file of 512-byte sectors. A transfer is set up in the sector,
+// address and count registers, and made when its command is written, copying whole sectors
+// between the file and memory at the physical address. The status register then reads 0, or
+// 1 if the sectors are beyond the end of the file or the file could not be accessed.
+class block_device : public device
+{
+
+private:
+   memory *main_memory;
+   fstream file;
+   uint64_t capacity;
+   uint64_t sector;
+   uint64_t address;
+   uint64_t count;
+   uint64_t status;
+
+   bool transfer(bool writing);
+
+public:
+   // Address of the registers in memory, and the length of the range they occupy
+   static const uint64_t default_base = 0x10001000;
+   static const uint64_t size = 0x1000;
+
+   // Register offsets, each a doubleword
+   static const uint64_t sector_register = 0x00;    // First sector of the transfer
+   static const uint64_t address_register = 0x08;   // Physical address of the data
+   static const uint64_t count_register = 0x10;     // Number of sectors
+   static const uint64_t command_register = 0x18;   // 1 to read sectors into memory, 2 to write them
+   static const uint64_t status_register = 0x20;    // Result of the last command
+   static const uint64_t capacity_register = 0x28;  // Sectors in the file (read only)
+   static const uint64_t sector_size = 512;
+
+   // Constructor, transferring between main_memory and nothing until opened
+   block_device(memory *main_memory);
+
+   // Open the file holding the sectors for reading and writing. Return false if it cannot be opened.
+   bool open(string file_name);
+
+   // Read or write the register bytes at an offset. Bytes with no register read as zero and
+   // ignore writes.
+   uint64_t read(uint64_t offset, unsigned int bytes, uint64_t now);
+   void write(uint64_t offset, unsigned int bytes, uint64_t value, uint64_t now);
+};
+
+#endif
@@ -0,0 +1,166 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class for running several harts over a shared memory
+
+**************************************************************** */
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "harts.h"
+
+using namespace std;
+
+hart_scheduler::hart_scheduler(memory *main_memory, unsigned int count, bool verbose, bool stage2,
+                               unsigned int quantum, bool parallel)
+{
+   this->main_memory = main_memory;
+   this->quantum = quantum > 0 ? quantum : 1;
+   this->parallel = parallel;
+   for (unsigned int id = 0; id < count; id++)
+   {
+      processor *hart = new processor(main_memory, verbose, stage2);
+      hart->set_hart_id(id);
+      harts.push_back(hart);
+   }
+}
+
+hart_scheduler::~hart_scheduler()
+{
+   for (unsigned int id = 0; id < harts.size(); id++)
+   {
+      delete harts[id];
+   }
+}
+
+void hart_scheduler::execute(unsigned int num, bool breakpoint_check)
+{
+   if (harts.size() == 1)
+   {
+      harts[0]->execute(num, breakpoint_check);
+   }
+   else if (parallel)
+   {
+      execute_in_parallel(num, breakpoint_check);
+   }
+   else
+   {
+      execute_in_turn(num, breakpoint_check);
+   }
+}
+
+// Run each hart for a quantum in turn, until every hart has run num instructions or stopped.
+// Each hart uses its own memory port, so that it keeps its own reservation.
+void hart_scheduler::execute_in_turn(unsigned int num, bool breakpoint_check)
+{
+   vector<unsigned int> remaining(harts.size(), num);
+   unsigned int running = harts.size();
+   while (running > 0)
+   {
+      for (unsigned int id = 0; id < harts.size(); id++)
+      {
+         if (remaining[id] == 0)
+         {
+            continue;
+         }
+         unsigned int step = remaining[id] < quantum ? remaining[id] : quantum;
+         memory::set_port(id);
+         bool stopped = harts[id]->execute(step, breakpoint_check);
+         remaining[id] = stopped ? 0 : remaining[id] - step;
+         if (remaining[id] == 0)
+         {
+            running--;
+         }
+      }
+   }
+   memory::set_port(0);
+}
+
+// Meeting point for the hart threads at the end of each quantum. A hart that has finished
+// leaves, so the others no longer wait for it.
+class quantum_barrier
+{
+
+private:
+   mutex lock;
+   condition_variable released;
+   unsigned int participants;
+   unsigned int waiting;
+   uint64_t round;
+
+   void release_if_complete()
+   {
+      if (waiting == participants && waiting > 0)
+      {
+         waiting = 0;
+         round++;
+         released.notify_all();
+      }
+   }
+
+public:
+   quantum_barrier(unsigned int count) : participants(count), waiting(0), round(0) {}
+
+   void wait()
+   {
+      unique_lock<mutex> guard(lock);
+      uint64_t arrived_round = round;
+      waiting++;
+      release_if_complete();
+      while (round == arrived_round)
+      {
+         released.wait(guard);
+      }
+   }
+
+   void leave()
+   {
+      lock_guard<mutex> guard(lock);
+      participants--;
+      release_if_complete();
+   }
+};
+
+// Run every hart on its own host thread, meeting after each quantum
+void hart_scheduler::execute_in_parallel(unsigned int num, bool breakpoint_check)
+{
+   quantum_barrier barrier(harts.size());
+   vector<thread> threads;
+   main_memory->set_shared(true);
+   for (unsigned int id = 0; id < harts.size(); id++)
+   {
+      threads.push_back(thread([this, id, num, breakpoint_check, &barrier]() {
+         memory::set_port(id);
+         unsigned int remaining = num;
+         while (remaining > 0)
+         {
+            unsigned int step = remaining < quantum ? remaining : quantum;
+            bool stopped = harts[id]->execute(step, breakpoint_check);
+            remaining = stopped ? 0 : remaining - step;
+            if (remaining > 0)
+            {
+               barrier.wait();
+            }
+         }
+         barrier.leave();
+      }));
+   }
+   for (unsigned int id = 0; id < threads.size(); id++)
+   {
+      threads[id].join();
+   }
+   main_memory->set_shared(false);
+}
+
+uint64_t hart_scheduler::get_instruction_count()
+{
+   uint64_t count = 0;
+   for (unsigned int id = 0; id < harts.size(); id++)
+   {
+      count += harts[id]->get_instruction_count();
+   }
+   return count;
+}
@@ -0,0 +1,55 @@
+#ifndef HARTS_H
+#define HARTS_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class for running several harts over a shared memory
+
+**************************************************************** */
+
+#include <stdint.h>
+#include <vector>
+
+#include "memory.h"
+#include "processor.h"
+
+using namespace std;
+
+// Harts, each a processor with its own mhartid, sharing one memory. They run in quanta of
+// instructions, either all at once on one host thread each, meeting after every quantum, or
+// in turn on the calling thread, which gives the same interleaving on every run.
+class hart_scheduler
+{
+
+private:
+   vector<processor *> harts;
+   memory *main_memory;
+   unsigned int quantum;
+   bool parallel;
+
+   void execute_in_turn(unsigned int num, bool breakpoint_check);
+   void execute_in_parallel(unsigned int num, bool breakpoint_check);
+
+public:
+   // Constructor, creating count harts. A quantum of 0 is taken as 1.
+   hart_scheduler(memory *main_memory, unsigned int count, bool verbose, bool stage2, unsigned int quantum,
+                  bool parallel);
+
+   // Destructor
+   ~hart_scheduler();
+
+   unsigned int get_hart_count() { return harts.size(); }
+   processor *get_hart(unsigned int id) { return harts[id]; }
+   const vector<processor *> &get_harts() { return harts; }
+
+   // Execute up to num instructions on each hart. A hart stops early at its breakpoint if
+   // breakpoint_check is set.
+   void execute(unsigned int num, bool breakpoint_check);
+
+   // Total instructions executed by all harts
+   uint64_t get_instruction_count();
+};
+
+#endif
@@ -11,34 +11,233 @@
 #include <iomanip>
 #include <stdlib.h>
 #include <cstdio>
+#include <cstring>
+#include <cctype>
 #include <map>
+#include <sstream>
+#include <algorithm>
+#include <type_traits>
 #include "memory.h"
+#include "device.h"
+#include "checkpoint.h"
 using namespace std;
 
+thread_local unsigned int memory::port = 0;
+
 // Constructor
 memory::memory(bool verbose)
 {
   // set verbose
   isVerbose = verbose;
+  code_generation = 0;
+  shared = false;
+  page_table = new page_table_node();
+  for (unsigned int n = 0; n < max_ports; n++)
+  {
+    for (int i = 0; i < 16; i++)
+    {
+      tlb[n][i].number = 0;
+      tlb[n][i].entry = NULL;
+      write_tlb[n][i].number = 0;
+      write_tlb[n][i].entry = NULL;
+    }
+    reservations[n].p = NULL;
+  }
+  snapshot_taken = false;
+  halted = false;
 }
 
-void memory::validate(uint64_t address)
+// Destructor
+memory::~memory()
 {
-  uint64_t page = address & ~2047; 
+  free_page_table(page_table, 0);
+  for (size_t i = 0; i < pages.size(); i++)
+  {
+    delete pages[i];
+  }
+  discard_snapshot();
+}
+
+void memory::free_page_table(page_table_node *node, int level)
+{
+  if (level < 4)
+  {
+    for (int i = 0; i < 2048; i++)
+    {
+      if (node->entries[i] != NULL)
+      {
+        free_page_table((page_table_node *)node->entries[i], level + 1);
+      }
+    }
+  }
+  delete node;
+}
 
-  if (store.find(page) == store.end()) 
+// Find the page with a page number (address / 2048) in the page table. If allocate is set,
+// missing interior nodes and the page are allocated, otherwise NULL is returned for a page
+// that has never been accessed. The 53-bit page number is split 9/11/11/11/11 across the levels.
+memory::page *memory::walk_page_table(uint64_t number, bool allocate)
+{
+  page_table_node *node = page_table;
+  for (int shift = 44; shift > 0; shift -= 11)
   {
-    store[page] = vector<uint64_t>(256, 0); 
+    void *&entry = node->entries[(number >> shift) & 2047];
+    if (entry == NULL)
+    {
+      if (!allocate)
+      {
+        return NULL;
+      }
+      entry = new page_table_node();
+    }
+    node = (page_table_node *)entry;
   }
+  void *&entry = node->entries[number & 2047];
+  if (entry == NULL && allocate)
+  {
+    page *new_page = new page();
+    new_page->address = number << 11;
+    new_page->saved = false;
+    new_page->reserved = 0;
+    new_page->owner = NULL;
+    new_page->owner_base = 0;
+    pages.push_back(new_page);
+    entry = new_page;
+  }
+  return (page *)entry;
+}
+
+// Find a page, allocating it if necessary. Pages are never freed while threads share
+// the memory, so only the walk needs the lock.
+memory::page *memory::allocate_page(uint64_t number)
+{
+  if (shared)
+  {
+    lock_guard<mutex> guard(lock);
+    return walk_page_table(number, true);
+  }
+  return walk_page_table(number, true);
+}
+
+// Find a page without allocating it, returning NULL if it has never been accessed
+memory::page *memory::find_existing_page(uint64_t number)
+{
+  if (shared)
+  {
+    lock_guard<mutex> guard(lock);
+    return walk_page_table(number, false);
+  }
+  return walk_page_table(number, false);
+}
+
+inline memory::page *memory::find_page(uint64_t address)
+{
+  uint64_t number = address >> 11;
+  tlb_entry &cached = tlb[port][number & 15];
+  if (cached.entry == NULL || cached.number != number)
+  {
+    cached.number = number;
+    cached.entry = allocate_page(number);
+  }
+  return cached.entry;
+}
+
+// Writes look pages up in their own TLB, which holds only pages already saved for the
+// current snapshot (or any page when there is none), so the check for a first write after
+// a snapshot is made only on a write TLB miss.
+inline memory::page *memory::find_writable_page(uint64_t address)
+{
+  uint64_t number = address >> 11;
+  tlb_entry &cached = write_tlb[port][number & 15];
+  if (cached.entry == NULL || cached.number != number)
+  {
+    page *p = find_page(address);
+    if (snapshot_taken && !p->saved)
+    {
+      save_page(p);
+    }
+    cached.number = number;
+    cached.entry = p;
+  }
+  return cached.entry;
+}
+
+void memory::save_page(page *p)
+{
+  unique_lock<mutex> guard(lock, defer_lock);
+  if (shared)
+  {
+    guard.lock();
+    if (p->saved)
+    {
+      return;
+    }
+  }
+  saved_page *saved = new saved_page;
+  saved->live = p;
+  memcpy(saved->data, p->data, sizeof(saved->data));
+  saved_pages.push_back(saved);
+  p->saved = true;
+}
+
+void memory::take_snapshot()
+{
+  discard_snapshot();
+  snapshot_taken = true;
+  for (unsigned int n = 0; n < max_ports; n++)
+  {
+    for (int i = 0; i < 16; i++)
+    {
+      write_tlb[n][i].entry = NULL;
+    }
+  }
+}
+
+bool memory::revert_to_snapshot()
+{
+  if (!snapshot_taken)
+  {
+    return false;
+  }
+  clear_reservations();
+  // The saved pages stay saved, so the next revert restores them again
+  for (size_t i = 0; i < saved_pages.size(); i++)
+  {
+    page *p = saved_pages[i]->live;
+    memcpy(p->data, saved_pages[i]->data, sizeof(p->data));
+    if (p->code.any())
+    {
+      p->code.reset();
+      code_generation++;
+    }
+  }
+  return true;
+}
+
+void memory::discard_snapshot()
+{
+  for (size_t i = 0; i < saved_pages.size(); i++)
+  {
+    delete saved_pages[i];
+  }
+  saved_pages.clear();
+  snapshot_taken = false;
+  for (size_t i = 0; i < pages.size(); i++)
+  {
+    pages[i]->saved = false;
+  }
+}
+
+void memory::validate(uint64_t address)
+{
+  find_page(address);
 }
 
 // Read a doubleword of data from a doubleword-aligned address.
 // If the address is not a multiple of 8, it is rounded down to a multiple of 8.
 uint64_t memory::read_doubleword(uint64_t address)
 {
-  address = address & ~7;                             
-  validate(address);                                  
-  return store[address & ~2047][(address & 2047) / 8]; 
+  return find_page(address)->data[(address & 2047) / 8];
 }
 
 // Write a doubleword of data to a doubleword-aligned address.
@@ -46,117 +245,839 @@ uint64_t memory::read_doubleword(uint64_t address)
 // The mask contains 1s for bytes to be updated and 0s for bytes that are to be unchanged.
 void memory::write_doubleword(uint64_t address, uint64_t data, uint64_t mask)
 {
-  address = address & ~7;
-  validate(address);
-  uint64_t maskData = (data & mask) | (store[address & ~2047][(address & 2047) / 8] & ~mask);
-  store[address & ~2047][(address & 2047) / 8] = maskData;
+  page *p = find_writable_page(address);
+  uint64_t &doubleword = p->data[(address & 2047) / 8];
+  doubleword = (data & mask) | (doubleword & ~mask);
+  check_write(p, address);
+}
+
+inline void memory::check_write(page *p, uint64_t address)
+{
+  if (p->code.test((address & 2047) / 8))
+  {
+    unique_lock<mutex> guard(lock, defer_lock);
+    if (shared)
+    {
+      guard.lock();
+    }
+    p->code.reset();
+    code_generation++;
+  }
+  if (p->reserved.load(memory_order_relaxed) != 0)
+  {
+    break_reservations(p, address, false);
+  }
+}
+
+void memory::break_reservations(page *p, uint64_t address, bool whole_page)
+{
+  unique_lock<mutex> guard(lock, defer_lock);
+  if (shared)
+  {
+    guard.lock();
+  }
+  for (unsigned int n = 0; n < max_ports; n++)
+  {
+    reservation &r = reservations[n];
+    if (n != port && r.p == p && (whole_page || (r.address & ~7ULL) == (address & ~7ULL)))
+    {
+      r.p = NULL;
+      p->reserved--;
+    }
+  }
+}
+
+void memory::clear_reservations()
+{
+  for (unsigned int n = 0; n < max_ports; n++)
+  {
+    if (reservations[n].p != NULL)
+    {
+      reservations[n].p->reserved--;
+      reservations[n].p = NULL;
+    }
+  }
+}
+
+// Apply an atomic memory operation to a word or doubleword of host memory, returning the old value
+template <typename T>
+static T apply_atomic(T *location, memory::atomic_op op, T data)
+{
+  typedef typename make_signed<T>::type signed_type;
+  switch (op)
+  {
+  case memory::amo_swap:
+    return __atomic_exchange_n(location, data, __ATOMIC_SEQ_CST);
+  case memory::amo_add:
+    return __atomic_fetch_add(location, data, __ATOMIC_SEQ_CST);
+  case memory::amo_xor:
+    return __atomic_fetch_xor(location, data, __ATOMIC_SEQ_CST);
+  case memory::amo_and:
+    return __atomic_fetch_and(location, data, __ATOMIC_SEQ_CST);
+  case memory::amo_or:
+    return __atomic_fetch_or(location, data, __ATOMIC_SEQ_CST);
+  default:
+    break;
+  }
+  // Minimum and maximum have no host instruction, so retry until no other write intervenes
+  T old = __atomic_load_n(location, __ATOMIC_RELAXED);
+  T result;
+  do
+  {
+    switch (op)
+    {
+    case memory::amo_min:
+      result = (signed_type)old < (signed_type)data ? old : data;
+      break;
+    case memory::amo_max:
+      result = (signed_type)old > (signed_type)data ? old : data;
+      break;
+    case memory::amo_minu:
+      result = old < data ? old : data;
+      break;
+    default:
+      result = old > data ? old : data;
+      break;
+    }
+  } while (!__atomic_compare_exchange_n(location, &old, result, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+  return old;
+}
+
+uint64_t memory::load_reserved(uint64_t address, bool word)
+{
+  page *p = find_page(address);
+  uint8_t *location = (uint8_t *)p->data + (address & 2047);
+  unique_lock<mutex> guard(lock, defer_lock);
+  if (shared)
+  {
+    guard.lock();
+  }
+  reservation &r = reservations[port];
+  if (r.p != NULL)
+  {
+    r.p->reserved--;
+  }
+  // The page is marked before the value is loaded, so a write through another port either
+  // changes the value loaded or sees the mark and breaks the reservation
+  p->reserved++;
+  r.p = p;
+  r.address = address;
+  r.word = word;
+  if (word)
+  {
+    r.value = __atomic_load_n((uint32_t *)location, __ATOMIC_SEQ_CST);
+  }
+  else
+  {
+    r.value = __atomic_load_n((uint64_t *)location, __ATOMIC_SEQ_CST);
+  }
+  return r.value;
 }
 
-// Load a hex image file and provide the start address for execution from the file in start_address.
+bool memory::store_conditional(uint64_t address, uint64_t data, bool word)
+{
+  page *p = find_writable_page(address);
+  uint8_t *location = (uint8_t *)p->data + (address & 2047);
+  bool stored;
+  {
+    unique_lock<mutex> guard(lock, defer_lock);
+    if (shared)
+    {
+      guard.lock();
+    }
+    reservation &r = reservations[port];
+    stored = r.p == p && r.address == address && r.word == word;
+    if (r.p != NULL)
+    {
+      r.p->reserved--;
+      r.p = NULL;
+    }
+    // Comparing with the value loaded also catches a plain write racing with the load-reserved
+    if (stored && word)
+    {
+      uint32_t expected = r.value;
+      stored = __atomic_compare_exchange_n((uint32_t *)location, &expected, (uint32_t)data, false,
+                                           __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+    else if (stored)
+    {
+      uint64_t expected = r.value;
+      stored = __atomic_compare_exchange_n((uint64_t *)location, &expected, data, false, __ATOMIC_SEQ_CST,
+                                           __ATOMIC_SEQ_CST);
+    }
+  }
+  if (stored)
+  {
+    check_write(p, address);
+  }
+  return stored;
+}
+
+uint64_t memory::atomic_update(uint64_t address, atomic_op op, uint64_t data, bool word)
+{
+  page *p = find_writable_page(address);
+  uint8_t *location = (uint8_t *)p->data + (address & 2047);
+  uint64_t old;
+  if (word)
+  {
+    old = apply_atomic((uint32_t *)location, op, (uint32_t)data);
+  }
+  else
+  {
+    old = apply_atomic((uint64_t *)location, op, data);
+  }
+  check_write(p, address);
+  return old;
+}
+
+// The width-specific accessors address the bytes of a page directly, which relies on
+// the host being little-endian like RISC-V.
+uint8_t memory::read8(uint64_t address)
+{
+  return ((uint8_t *)find_page(address)->data)[address & 2047];
+}
+
+uint16_t memory::read16(uint64_t address)
+{
+  uint16_t data;
+  memcpy(&data, (uint8_t *)find_page(address)->data + (address & 2047), sizeof(data));
+  return data;
+}
+
+uint32_t memory::read32(uint64_t address)
+{
+  uint32_t data;
+  memcpy(&data, (uint8_t *)find_page(address)->data + (address & 2047), sizeof(data));
+  return data;
+}
+
+uint64_t memory::read64(uint64_t address)
+{
+  return find_page(address)->data[(address & 2047) / 8];
+}
+
+uint8_t *memory::host_page(uint64_t address)
+{
+  page *p = find_page(address);
+  return p->owner == NULL ? (uint8_t *)p->data : NULL;
+}
+
+// Devices are marked in the pages they claim, so they are found by the page lookup that
+// any access makes anyway
+bool memory::add_device(uint64_t base, uint64_t size, device *owner)
+{
+  uint64_t first = base & ~(uint64_t)2047;
+  for (uint64_t address = first; address < base + size; address += 2048)
+  {
+    if (find_page(address)->owner != NULL)
+    {
+      return false;
+    }
+  }
+  for (uint64_t address = first; address < base + size; address += 2048)
+  {
+    page *p = find_page(address);
+    p->owner = owner;
+    p->owner_base = base;
+  }
+  return true;
+}
+
+uint64_t memory::device_read(uint64_t address, unsigned int bytes, uint64_t now)
+{
+  page *p = find_page(address);
+  unique_lock<mutex> guard(device_lock, defer_lock);
+  if (shared)
+  {
+    guard.lock();
+  }
+  return p->owner->read(address - p->owner_base, bytes, now);
+}
+
+void memory::device_write(uint64_t address, unsigned int bytes, uint64_t value, uint64_t now)
+{
+  page *p = find_page(address);
+  unique_lock<mutex> guard(device_lock, defer_lock);
+  if (shared)
+  {
+    guard.lock();
+  }
+  p->owner->write(address - p->owner_base, bytes, value, now);
+}
+
+void memory::write8(uint64_t address, uint8_t data)
+{
+  page *p = find_writable_page(address);
+  ((uint8_t *)p->data)[address & 2047] = data;
+  check_write(p, address);
+}
+
+void memory::write16(uint64_t address, uint16_t data)
+{
+  page *p = find_writable_page(address);
+  memcpy((uint8_t *)p->data + (address & 2047), &data, sizeof(data));
+  check_write(p, address);
+}
+
+void memory::write32(uint64_t address, uint32_t data)
+{
+  page *p = find_writable_page(address);
+  memcpy((uint8_t *)p->data + (address & 2047), &data, sizeof(data));
+  check_write(p, address);
+}
+
+void memory::write64(uint64_t address, uint64_t data)
+{
+  page *p = find_writable_page(address);
+  p->data[(address & 2047) / 8] = data;
+  check_write(p, address);
+}
+
+void memory::mark_code(uint64_t address)
+{
+  page *p = find_page(address);
+  unique_lock<mutex> guard(lock, defer_lock);
+  if (shared)
+  {
+    guard.lock();
+  }
+  p->code.set((address & 2047) / 8);
+}
+
+bool memory::is_code_page(uint64_t address)
+{
+  return find_page(address)->code.any();
+}
+
+// Unmark a page holding decoded code in any of count bytes from offset, under the lock like
+// check_write
+void memory::unmark_code(page *p, uint64_t offset, uint64_t count)
+{
+  for (uint64_t i = offset / 8; i <= (offset + count - 1) / 8; i++)
+  {
+    if (p->code.test(i))
+    {
+      unique_lock<mutex> guard(lock, defer_lock);
+      if (shared)
+      {
+        guard.lock();
+      }
+      p->code.reset();
+      code_generation++;
+      break;
+    }
+  }
+}
+
+// Copy a run of bytes out of memory, a page at a time
+void memory::read_bytes(uint64_t address, uint8_t *data, uint64_t length)
+{
+  while (length > 0)
+  {
+    uint64_t offset = address & 2047;
+    uint64_t count = 2048 - offset;
+    if (count > length)
+    {
+      count = length;
+    }
+    memcpy(data, (uint8_t *)find_page(address)->data + offset, count);
+    address += count;
+    data += count;
+    length -= count;
+  }
+}
+
+// Copy a run of bytes into memory, a page at a time
+void memory::write_bytes(uint64_t address, const uint8_t *data, uint64_t length)
+{
+  while (length > 0)
+  {
+    page *p = find_writable_page(address);
+    uint64_t offset = address & 2047;
+    uint64_t count = 2048 - offset;
+    if (count > length)
+    {
+      count = length;
+    }
+    memcpy((uint8_t *)p->data + offset, data, count);
+    if (p->reserved.load(memory_order_relaxed) != 0)
+    {
+      break_reservations(p, address, true);
+    }
+    unmark_code(p, offset, count);
+    address += count;
+    data += count;
+    length -= count;
+  }
+}
+
+// Clear a run of bytes in memory. Pages that have never been accessed are already zero,
+// so they are left unallocated.
+void memory::zero_bytes(uint64_t address, uint64_t length)
+{
+  while (length > 0)
+  {
+    uint64_t offset = address & 2047;
+    uint64_t count = 2048 - offset;
+    if (count > length)
+    {
+      count = length;
+    }
+    page *p = find_existing_page(address >> 11);
+    if (p != NULL && snapshot_taken && !p->saved)
+    {
+      save_page(p);
+    }
+    if (p != NULL)
+    {
+      memset((uint8_t *)p->data + offset, 0, count);
+      if (p->reserved.load(memory_order_relaxed) != 0)
+      {
+        break_reservations(p, address, true);
+      }
+      unmark_code(p, offset, count);
+    }
+    address += count;
+    length -= count;
+  }
+}
+
+// Value of each hex digit character, or -1 for characters that are not hex digits
+static const signed char *hex_digit_values()
+{
+  static signed char values[256];
+  static bool initialized = false;
+  if (!initialized)
+  {
+    for (int i = 0; i < 256; i++)
+    {
+      values[i] = -1;
+    }
+    for (int i = 0; i < 10; i++)
+    {
+      values['0' + i] = i;
+    }
+    for (int i = 0; i < 6; i++)
+    {
+      values['a' + i] = 10 + i;
+      values['A' + i] = 10 + i;
+    }
+    initialized = true;
+  }
+  return values;
+}
+
+// Load a hex image or ELF file and provide the start address for execution from the file in start_address.
+// The file type is selected by the ELF magic number at the start of the file.
 // Return true if the file was read without error, or false otherwise.
 bool memory::load_file(string file_name, uint64_t &start_address)
 {
-  ifstream input_file(file_name);
-  string input;
+  ifstream input_file(file_name, ios::binary);
+  if (!input_file.is_open())
+  {
+    cout << "Failed to open file" << endl;
+    return false;
+  }
+  input_file.seekg(0, ios::end);
+  vector<char> text((size_t)input_file.tellg());
+  input_file.seekg(0, ios::beg);
+  input_file.read(text.data(), text.size());
+  input_file.close();
+
+  if (text.size() >= 4 && text[0] == 0x7f && text[1] == 'E' && text[2] == 'L' && text[3] == 'F')
+  {
+    return load_elf(text, start_address);
+  }
+  return load_hex(text, start_address);
+}
+
+// Load an Intel hex image that has been read into text.
+// Consecutive data records are collected into a single run of bytes that is copied into
+// memory a page at a time.
+bool memory::load_hex(const vector<char> &text, uint64_t &start_address)
+{
+  const signed char *hex_values = hex_digit_values();
+  const char *next = text.data();
+  const char *end = text.data() + text.size();
   unsigned int line_count = 0;
-  unsigned int byte_count = 0;
-  char record_start;
-  char byte_string[3];
-  char halfword_string[5];
-  unsigned int record_length;
-  unsigned int record_address;
-  unsigned int record_type;
-  unsigned int record_data;
-  unsigned int record_checksum;
-  bool end_of_file_record = false;
-  uint64_t load_address;
-  uint64_t load_data;
-  uint64_t load_mask;
+  uint64_t byte_count = 0;
+  uint8_t record[256 + 5];
+  vector<uint8_t> run;
+  uint64_t run_address = 0;
   uint64_t load_base_address = 0x0000000000000000ULL;
   start_address = 0x0000000000000000ULL;
-  if (input_file.is_open())
+  while (true)
   {
-    while (true)
+    line_count++;
+    while (next < end && isspace((unsigned char)*next))
     {
-      line_count++;
-      input_file >> record_start;
-      if (record_start != ':')
+      next++;
+    }
+    if (next == end)
+    {
+      cout << "No end of file record after input line " << dec << line_count - 1 << endl;
+      return false;
+    }
+    if (*next != ':')
+    {
+      cout << "Input line " << dec << line_count << " does not start with colon character" << endl;
+      return false;
+    }
+    next++;
+
+    // Decode the length byte, then the rest of the record: address, type, data and checksum
+    unsigned int record_bytes = 1;
+    uint8_t checksum = 0;
+    for (unsigned int i = 0; i < record_bytes; i++)
+    {
+      if (end - next < 2 || hex_values[(unsigned char)next[0]] < 0 || hex_values[(unsigned char)next[1]] < 0)
       {
-        cout << "Input line " << dec << line_count << " does not start with colon character" << endl;
+        cout << "Input line " << dec << line_count << " contains an invalid or incomplete record" << endl;
         return false;
       }
-      input_file.get(byte_string, 3);
-      sscanf(byte_string, "%x", &record_length);
-      input_file.get(halfword_string, 5);
-      sscanf(halfword_string, "%x", &record_address);
-      input_file.get(byte_string, 3);
-      sscanf(byte_string, "%x", &record_type);
-      switch (record_type)
+      record[i] = (hex_values[(unsigned char)next[0]] << 4) | hex_values[(unsigned char)next[1]];
+      checksum += record[i];
+      next += 2;
+      if (i == 0)
       {
-      case 0x00: // Data record
-        for (unsigned int i = 0; i < record_length; i++)
-        {
-          input_file.get(byte_string, 3);
-          sscanf(byte_string, "%x", &record_data);
-          load_address = (load_base_address | (uint64_t)(record_address)) + i;
-          load_data = (uint64_t)(record_data) << ((load_address % 8) * 8);
-          load_mask = 0x00000000000000ffULL << ((load_address % 8) * 8);
-          write_doubleword(load_address & 0xfffffffffffffff8ULL, load_data, load_mask);
-          byte_count++;
-        }
-        break;
-      case 0x01: // End of file
-        end_of_file_record = true;
-        break;
-      case 0x02: // Extended segment address (set bits 19:4 of load base address)
-        load_base_address = 0x0000000000000000ULL;
-        for (unsigned int i = 0; i < record_length; i++)
-        {
-          input_file.get(byte_string, 3);
-          sscanf(byte_string, "%x", &record_data);
-          load_base_address = (load_base_address << 8) | (record_data << 4);
-        }
-        break;
-      case 0x03: // Start segment address (ignored)
-        for (unsigned int i = 0; i < record_length; i++)
-        {
-          input_file.get(byte_string, 3);
-          sscanf(byte_string, "%x", &record_data);
-        }
-        break;
-      case 0x04: // Extended linear address (set upper halfword of load base address)
-        load_base_address = 0x0000000000000000ULL;
-        for (unsigned int i = 0; i < record_length; i++)
-        {
-          input_file.get(byte_string, 3);
-          sscanf(byte_string, "%x", &record_data);
-          load_base_address = (load_base_address << 8) | (record_data << 16);
-        }
-        break;
-      case 0x05: // Start linear address (set execution start address)
-        start_address = 0x0000000000000000ULL;
-        for (unsigned int i = 0; i < record_length; i++)
+        record_bytes = record[0] + 5;
+      }
+    }
+    if (checksum != 0)
+    {
+      cout << "Input line " << dec << line_count << " has an incorrect checksum" << endl;
+      return false;
+    }
+
+    unsigned int record_length = record[0];
+    unsigned int record_address = (record[1] << 8) | record[2];
+    unsigned int record_type = record[3];
+    const uint8_t *record_data = record + 4;
+    switch (record_type)
+    {
+    case 0x00: // Data record
+    {
+      uint64_t load_address = load_base_address | (uint64_t)(record_address);
+      if (!run.empty() && load_address != run_address + run.size())
+      {
+        write_bytes(run_address, run.data(), run.size());
+        run.clear();
+      }
+      if (run.empty())
+      {
+        run_address = load_address;
+      }
+      run.insert(run.end(), record_data, record_data + record_length);
+      byte_count += record_length;
+    }
+    break;
+    case 0x01: // End of file
+      if (!run.empty())
+      {
+        write_bytes(run_address, run.data(), run.size());
+      }
+      cout << dec << byte_count << " bytes loaded, start address = "
+           << setw(16) << setfill('0') << hex << start_address << endl;
+      return true;
+    case 0x02: // Extended segment address (set bits 19:4 of load base address)
+      load_base_address = 0x0000000000000000ULL;
+      for (unsigned int i = 0; i < record_length; i++)
+      {
+        load_base_address = (load_base_address << 8) | ((uint64_t)record_data[i] << 4);
+      }
+      break;
+    case 0x03: // Start segment address (ignored)
+      break;
+    case 0x04: // Extended linear address (set upper halfword of load base address)
+      load_base_address = 0x0000000000000000ULL;
+      for (unsigned int i = 0; i < record_length; i++)
+      {
+        load_base_address = (load_base_address << 8) | ((uint64_t)record_data[i] << 16);
+      }
+      break;
+    case 0x05: // Start linear address (set execution start address)
+      start_address = 0x0000000000000000ULL;
+      for (unsigned int i = 0; i < record_length; i++)
+      {
+        start_address = (start_address << 8) | record_data[i];
+      }
+      break;
+    }
+  }
+}
+
+// Read a little-endian field of an ELF file
+static uint64_t elf_field(const vector<char> &text, uint64_t offset, int size)
+{
+  uint64_t value = 0;
+  for (int i = size - 1; i >= 0; i--)
+  {
+    value = (value << 8) | (uint8_t)text[offset + i];
+  }
+  return value;
+}
+
+// Load a 64-bit little-endian RISC-V ELF executable that has been read into text.
+// The file contents of each PT_LOAD segment are copied to its physical address, and the rest
+// of the segment (.bss) is cleared. Function symbols from the symbol table are kept for
+// reporting by address.
+// Largest segment loaded from an ELF file, so that a malformed size cannot make clearing the
+// rest of a segment run for ever
+static const uint64_t max_segment_size = 1ULL << 32;
+
+bool memory::load_elf(const vector<char> &text, uint64_t &start_address)
+{
+  if (text.size() < 64 || text[4] != 2 || text[5] != 1 || elf_field(text, 18, 2) != 243)
+  {
+    cout << "ELF file is not a 64-bit little-endian RISC-V file" << endl;
+    return false;
+  }
+  start_address = elf_field(text, 24, 8);
+  uint64_t phoff = elf_field(text, 32, 8);
+  uint64_t shoff = elf_field(text, 40, 8);
+  uint64_t phentsize = elf_field(text, 54, 2);
+  uint64_t phnum = elf_field(text, 56, 2);
+  uint64_t shentsize = elf_field(text, 58, 2);
+  uint64_t shnum = elf_field(text, 60, 2);
+  // Each term is bounded on its own, so that a malformed offset cannot wrap a sum past the
+  // checks. The counts and entry sizes are 16-bit, so their products cannot overflow.
+  uint64_t size = text.size();
+  if (phoff > size || phnum * phentsize > size - phoff || (phnum > 0 && phentsize < 56) ||
+      shoff > size || shnum * shentsize > size - shoff || (shnum > 0 && shentsize < 64))
+  {
+    cout << "ELF file headers are truncated" << endl;
+    return false;
+  }
+
+  uint64_t byte_count = 0;
+  for (uint64_t i = 0; i < phnum; i++)
+  {
+    uint64_t header = phoff + i * phentsize;
+    if (elf_field(text, header, 4) != 1) // PT_LOAD
+    {
+      continue;
+    }
+    uint64_t offset = elf_field(text, header + 8, 8);
+    uint64_t address = elf_field(text, header + 24, 8);
+    uint64_t file_size = elf_field(text, header + 32, 8);
+    uint64_t memory_size = elf_field(text, header + 40, 8);
+    if (offset > size || file_size > size - offset || file_size > memory_size)
+    {
+      cout << "ELF segment " << dec << i << " is truncated" << endl;
+      return false;
+    }
+    if (memory_size > max_segment_size || address + memory_size < address)
+    {
+      cout << "ELF segment " << dec << i << " is too large" << endl;
+      return false;
+    }
+    write_bytes(address, (const uint8_t *)text.data() + offset, file_size);
+    zero_bytes(address + file_size, memory_size - file_size);
+    byte_count += file_size;
+  }
+
+  symbols.clear();
+  for (uint64_t i = 0; i < shnum; i++)
+  {
+    uint64_t header = shoff + i * shentsize;
+    if (elf_field(text, header + 4, 4) != 2) // SHT_SYMTAB
+    {
+      continue;
+    }
+    uint64_t offset = elf_field(text, header + 24, 8);
+    uint64_t table_size = elf_field(text, header + 32, 8);
+    uint64_t link = elf_field(text, header + 40, 4);
+    if (link >= shnum || offset > size || table_size > size - offset)
+    {
+      continue;
+    }
+    uint64_t strings = elf_field(text, shoff + link * shentsize + 24, 8);
+    uint64_t strings_size = elf_field(text, shoff + link * shentsize + 32, 8);
+    if (strings > size || strings_size > size - strings)
+    {
+      continue;
+    }
+    for (uint64_t entry = offset; entry + 24 <= offset + table_size; entry += 24)
+    {
+      uint64_t name = elf_field(text, entry, 4);
+      uint64_t type = elf_field(text, entry + 4, 1) & 0xf;
+      uint64_t section = elf_field(text, entry + 6, 2);
+      // Keep functions and untyped code labels, but not local assembler labels
+      if ((type != 2 && type != 0) || section == 0 || section >= 0xff00 || name == 0 || name >= strings_size)
+      {
+        continue;
+      }
+      symbol s;
+      s.name = string(text.data() + strings + name, strnlen(text.data() + strings + name, strings_size - name));
+      if (s.name.compare(0, 2, ".L") == 0 || s.name[0] == '$')
+      {
+        continue;
+      }
+      s.address = elf_field(text, entry + 8, 8);
+      s.size = elf_field(text, entry + 16, 8);
+      symbols.push_back(s);
+    }
+  }
+  sort(symbols.begin(), symbols.end());
+
+  cout << dec << byte_count << " bytes loaded, start address = "
+       << setw(16) << setfill('0') << hex << start_address << endl;
+  return true;
+}
+
+bool memory::page_before(const page *a, const page *b)
+{
+  return a->address < b->address;
+}
+
+void memory::save_pages(vector<uint8_t> &out)
+{
+  vector<page *> sorted(pages);
+  sort(sorted.begin(), sorted.end(), page_before);
+  vector<uint8_t> page_data;
+  uint64_t count = 0;
+  for (size_t i = 0; i < sorted.size(); i++)
+  {
+    uint64_t mask[4] = {0, 0, 0, 0};
+    for (int j = 0; j < 256; j++)
+    {
+      if (sorted[i]->data[j] != 0)
+      {
+        mask[j / 64] |= 1ULL << (j % 64);
+      }
+    }
+    if ((mask[0] | mask[1] | mask[2] | mask[3]) == 0)
+    {
+      continue;
+    }
+    count++;
+    checkpoint_put(page_data, sorted[i]->address);
+    for (int j = 0; j < 4; j++)
+    {
+      checkpoint_put(page_data, mask[j]);
+    }
+    for (int j = 0; j < 256; j++)
+    {
+      if (sorted[i]->data[j] != 0)
+      {
+        checkpoint_put(page_data, sorted[i]->data[j]);
+      }
+    }
+  }
+  checkpoint_put(out, count);
+  out.insert(out.end(), page_data.begin(), page_data.end());
+}
+
+bool memory::restore_pages(const uint8_t *data, uint64_t length, bool apply)
+{
+  const uint8_t *in = data;
+  const uint8_t *end = data + length;
+  uint64_t count;
+  if (!checkpoint_get(in, end, count))
+  {
+    return false;
+  }
+  if (apply)
+  {
+    // Clear the current contents, keeping the pages allocated, and drop all decoded code
+    discard_snapshot();
+    clear_reservations();
+    for (size_t i = 0; i < pages.size(); i++)
+    {
+      memset(pages[i]->data, 0, sizeof(pages[i]->data));
+      pages[i]->code.reset();
+    }
+    code_generation++;
+  }
+  for (uint64_t i = 0; i < count; i++)
+  {
+    uint64_t address;
+    uint64_t mask[4];
+    if (!checkpoint_get(in, end, address) || address % 2048 != 0)
+    {
+      return false;
+    }
+    for (int j = 0; j < 4; j++)
+    {
+      if (!checkpoint_get(in, end, mask[j]))
+      {
+        return false;
+      }
+    }
+    page *p = apply ? find_page(address) : NULL;
+    for (int j = 0; j < 256; j++)
+    {
+      uint64_t value = 0;
+      if ((mask[j / 64] >> (j % 64)) & 1)
+      {
+        if (!checkpoint_get(in, end, value))
         {
-          input_file.get(byte_string, 3);
-          sscanf(byte_string, "%x", &record_data);
-          start_address = (start_address << 8) | record_data;
+          return false;
         }
-        break;
       }
-      input_file.get(byte_string, 3);
-      sscanf(byte_string, "%x", &record_checksum);
-      input_file.ignore();
-      if (end_of_file_record)
-        break;
+      if (apply)
+      {
+        p->data[j] = value;
+      }
     }
-    input_file.close();
-    cout << dec << byte_count << " bytes loaded, start address = "
-         << setw(16) << setfill('0') << hex << start_address << endl;
-    return true;
   }
-  else
+  return in == end;
+}
+
+bool memory::load_symbol_map(string file_name)
+{
+  ifstream file(file_name.c_str());
+  if (!file)
   {
-    cout << "Failed to open file" << endl;
+    cout << "Failed to open symbol map file " << file_name << endl;
     return false;
   }
+  string line;
+  unsigned int line_count = 0;
+  while (getline(file, line))
+  {
+    line_count++;
+    stringstream fields(line);
+    string address, name, type;
+    if (!(fields >> address >> name))
+    {
+      continue;
+    }
+    if (fields >> type)
+    {
+      swap(name, type);
+    }
+    char *end;
+    symbol s;
+    s.address = strtoull(address.c_str(), &end, 16);
+    if (*end != '\0')
+    {
+      cout << "Invalid address in symbol map line " << dec << line_count << endl;
+      return false;
+    }
+    s.size = 0;
+    s.name = name;
+    symbols.push_back(s);
+  }
+  sort(symbols.begin(), symbols.end());
+  return true;
+}
+
+// Find the symbol containing an address, or the nearest symbol below it if sizes are
+// not known. Return NULL if there is no symbol at or below the address.
+const memory::symbol *memory::find_symbol(uint64_t address) const
+{
+  symbol key;
+  key.address = address;
+  vector<symbol>::const_iterator it = upper_bound(symbols.begin(), symbols.end(), key);
+  if (it == symbols.begin())
+  {
+    return NULL;
+  }
+  --it;
+  if (it->size != 0 && address >= it->address + it->size)
+  {
+    return NULL;
+  }
+  return &*it;
 }
@@ -10,23 +10,146 @@
 **************************************************************** */
 
 #include <vector>
-#include <unordered_map>
+#include <bitset>
+#include <stdint.h>
+#include <string>
+#include <mutex>
+#include <atomic>
 
 using namespace std;
 
+class device;
+
 class memory
 {
 
+public:
+   // Number of threads that can access memory at once, each through its own port
+   static const unsigned int max_ports = 64;
+
+   // Operations of the atomic memory operation instructions
+   enum atomic_op
+   {
+      amo_swap, amo_add, amo_xor, amo_and, amo_or, amo_min, amo_max, amo_minu, amo_maxu
+   };
+
+   // A function symbol from an ELF file
+   struct symbol
+   {
+      uint64_t address;
+      uint64_t size;
+      string name;
+      bool operator<(const symbol &other) const { return address < other.address; }
+   };
+
 private:
-   // Store implemented as an unordered_map of vectors, each containing 4Kbytes (512 doublewords) of data.
-   unordered_map<uint64_t, vector<uint64_t>> store;
+   // A page of store, containing 2Kbytes (256 doublewords) of data
+   struct page
+   {
+      uint64_t data[256];
+      // Address of the first byte of the page
+      uint64_t address;
+      // A bit for each doubleword that holds an instruction the processor has decoded and cached
+      bitset<256> code;
+      // Set once the contents of the page have been saved for the snapshot
+      bool saved;
+      // Number of ports holding a reservation in the page
+      atomic<unsigned int> reserved;
+      // The device claiming the page, if any, and the address of the start of its range
+      device *owner;
+      uint64_t owner_base;
+   };
+
+   // Contents of a page at the time of the snapshot, saved on the first write after it
+   struct saved_page
+   {
+      page *live;
+      uint64_t data[256];
+   };
+
+   // Interior node of the page table. Each level translates 11 bits of the page number,
+   // except the root which translates the top 9 bits.
+   struct page_table_node
+   {
+      void *entries[2048];
+   };
+
+   // Reservation made by a load-reserved, with the value it loaded. page is NULL if there is none.
+   struct reservation
+   {
+      page *p;
+      uint64_t address;
+      bool word;
+      uint64_t value;
+   };
+
+   // Cached translation from a page number to its page
+   struct tlb_entry
+   {
+      uint64_t number;
+      page *entry;
+   };
+
+   // Store implemented as a radix page table with five levels, each page allocated and
+   // zeroed the first time it is accessed
+   page_table_node *page_table;
+   // Allocated pages, in order of allocation
+   vector<page *> pages;
+   // Direct-mapped cache of recent page table lookups, indexed by the low bits of the page number,
+   // one for each port
+   tlb_entry tlb[max_ports][16];
+   // The same for pages that can be written without saving them for the snapshot first
+   tlb_entry write_tlb[max_ports][16];
+   // Port used by the calling thread
+   static thread_local unsigned int port;
+   // Reservation held by each port
+   reservation reservations[max_ports];
+   // Set while threads share the memory, so that changes to the page table, code marks
+   // and saved pages are made under the lock
+   bool shared;
+   mutex lock;
    // used to store if verbose is passed
    bool isVerbose;
+   // Incremented whenever a write modifies a decoded instruction
+   atomic<uint64_t> code_generation;
+   // Symbols from the last ELF file loaded, sorted by address
+   vector<symbol> symbols;
+   // Whether there is a snapshot, and the pages saved for it
+   bool snapshot_taken;
+   vector<saved_page *> saved_pages;
+   // Serializes device accesses while threads share the memory
+   mutex device_lock;
+   // Set by a device to stop every hart
+   atomic<bool> halted;
+
+   // Return the page containing an address, allocating it if necessary
+   page *find_page(uint64_t address);
+   page *walk_page_table(uint64_t number, bool allocate);
+   page *allocate_page(uint64_t number);
+   page *find_existing_page(uint64_t number);
+   // Return the page containing an address for writing, first saving it for the snapshot
+   page *find_writable_page(uint64_t address);
+   void save_page(page *p);
+   // Report a write to a doubleword of a page if it holds decoded code, and break the
+   // reservations other ports hold on it
+   void check_write(page *p, uint64_t address);
+   // Unmark a page if any of count bytes from offset hold decoded code
+   void unmark_code(page *p, uint64_t offset, uint64_t count);
+   // Break the reservations other ports hold on a doubleword of a page, or anywhere in the page
+   void break_reservations(page *p, uint64_t address, bool whole_page);
+   void clear_reservations();
+   void free_page_table(page_table_node *node, int level);
+   static bool page_before(const page *a, const page *b);
+   bool load_hex(const vector<char> &text, uint64_t &start_address);
+   bool load_elf(const vector<char> &text, uint64_t &start_address);
 
 public:
    // Constructor
    memory(bool verbose);
-   
+
+   // Destructor
+   ~memory();
+
    // Check if a page of store is allocated, and allocate if not
    void validate(uint64_t address);
 
@@ -39,9 +162,110 @@ public:
    // The mask contains 1s for bytes to be updated and 0s for bytes that are to be unchanged.
    void write_doubleword(uint64_t address, uint64_t data, uint64_t mask);
 
-   // Load a hex image file and provide the start address for execution from the file in start_address.
-   // Return true if the file was read without error, or false otherwise.
+   // Read naturally aligned data of a given width from an address.
+   // The address must be a multiple of the width, so the access is within one doubleword.
+   uint8_t read8(uint64_t address);
+   uint16_t read16(uint64_t address);
+   uint32_t read32(uint64_t address);
+   uint64_t read64(uint64_t address);
+
+   // Write naturally aligned data of a given width to an address, leaving the other bytes
+   // of the doubleword unchanged. The address must be a multiple of the width.
+   void write8(uint64_t address, uint8_t data);
+   void write16(uint64_t address, uint16_t data);
+   void write32(uint64_t address, uint32_t data);
+   void write64(uint64_t address, uint64_t data);
+
+   // Host address of the data of the page containing an address, allocating the page if
+   // necessary, or NULL if a device claims the page. Pages are never freed, so the address can
+   // be cached for reading. Writes must go through the write functions, which keep snapshots,
+   // decoded code and reservations consistent.
+   uint8_t *host_page(uint64_t address);
+
+   // Claim the pages covering size bytes from base for a device. Return false if a page is
+   // already claimed. The read and write functions still reach the memory behind a device;
+   // only device_read and device_write pass accesses to it, so callers that cache host pages
+   // find devices when a page has no host address, and memory accesses pay nothing for them.
+   bool add_device(uint64_t base, uint64_t size, device *owner);
+
+   // Pass an access to the device claiming an address, made by a hart whose instruction
+   // count is now
+   uint64_t device_read(uint64_t address, unsigned int bytes, uint64_t now);
+   void device_write(uint64_t address, unsigned int bytes, uint64_t value, uint64_t now);
+
+   // Stop every hart, as when a device powers the machine off, and check if that has happened
+   void halt() { halted = true; }
+   bool is_halted() { return halted.load(memory_order_relaxed); }
+
+   // Copy a run of bytes out of memory starting at any address
+   void read_bytes(uint64_t address, uint8_t *data, uint64_t length);
+
+   // Copy a run of bytes into memory starting at any address
+   void write_bytes(uint64_t address, const uint8_t *data, uint64_t length);
+
+   // Clear a run of bytes in memory starting at any address
+   void zero_bytes(uint64_t address, uint64_t length);
+
+   // Load a naturally aligned word (zero-extended) or doubleword and reserve it for the calling port.
+   // The reservation is broken by any write to the doubleword through another port.
+   uint64_t load_reserved(uint64_t address, bool word);
+
+   // Store a word or doubleword if the calling port still holds a reservation on the same address
+   // and width, and the value loaded is still there. The reservation is released either way.
+   // Return true if the store was made.
+   bool store_conditional(uint64_t address, uint64_t data, bool word);
+
+   // Apply an atomic memory operation to a naturally aligned word or doubleword with data,
+   // as one indivisible host atomic operation, and return the old value (zero-extended)
+   uint64_t atomic_update(uint64_t address, atomic_op op, uint64_t data, bool word);
+
+   // Mark the doubleword at an address as holding a decoded instruction, so that writes to it are reported
+   void mark_code(uint64_t address);
+
+   // Check if a page is still marked as holding decoded instructions
+   bool is_code_page(uint64_t address);
+
+   // Changes whenever a write modifies a marked doubleword (its whole page is unmarked at the same time)
+   uint64_t get_code_generation() { return code_generation.load(memory_order_relaxed); }
+
+   // Select the port used by the calling thread, below max_ports. Threads start on port 0.
+   static void set_port(unsigned int number) { port = number; }
+
+   // Set while several threads access the memory at once, each on its own port
+   void set_shared(bool shared) { this->shared = shared; }
+
+   // Load a hex image or ELF executable file and provide the start address for execution from the file
+   // in start_address. Return true if the file was read without error, or false otherwise.
    bool load_file(string file_name, uint64_t &start_address);
+
+   // Take a snapshot of the contents of memory. Pages are saved only when first written after
+   // the snapshot, so taking one costs nothing per page.
+   void take_snapshot();
+
+   // Return the contents of memory to the snapshot, in time proportional to the pages written
+   // since it was taken. Return false if there is no snapshot.
+   bool revert_to_snapshot();
+
+   // Discard the snapshot
+   void discard_snapshot();
+
+   // Append each page holding non-zero data to checkpoint data, as its address, a 256-bit mask
+   // of its non-zero doublewords and those doublewords
+   void save_pages(vector<uint8_t> &out);
+
+   // Check pages in checkpoint data and, if apply is set, replace the contents of memory with
+   // them, discarding any snapshot. Return false if the data is not valid.
+   bool restore_pages(const uint8_t *data, uint64_t length, bool apply);
+
+   // Add symbols from a map file, with a hex address and a name on each line, optionally separated
+   // by a type letter as in nm output. Return true if the file was read without error.
+   bool load_symbol_map(string file_name);
+
+   // Symbols from the last ELF file loaded and any map files, sorted by address
+   const vector<symbol> &get_symbols() const { return symbols; }
+
+   // Find the symbol containing an address, or NULL if there is none
+   const symbol *find_symbol(uint64_t address) const;
 };
 
 #endif
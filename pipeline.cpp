@@ -0,0 +1,61 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class members for the cycle model
+
+**************************************************************** */
+
+#include <stdlib.h>
+#include "pipeline.h"
+
+using namespace std;
+
+// Constructor, with penalties for a 5-stage pipeline with full forwarding, static
+// not-taken branch prediction and single-cycle memory
+pipeline_model::pipeline_model()
+{
+   fill_cycles = 4;
+   load_use_penalty = 1;
+   branch_penalty = 2;
+   jal_penalty = 1;
+   jalr_penalty = 2;
+   memory_latency = 0;
+   trap_penalty = 3;
+   mret_penalty = 3;
+   cycles = 0;
+   started = false;
+   load_destination = 0;
+}
+
+bool pipeline_model::configure(string setting)
+{
+   size_t equals = setting.find('=');
+   if (equals == string::npos || equals + 1 == setting.length())
+   {
+      return false;
+   }
+   string name = setting.substr(0, equals);
+   char *end;
+   uint64_t value = strtoull(setting.c_str() + equals + 1, &end, 10);
+   if (*end != '\0')
+   {
+      return false;
+   }
+   struct
+   {
+      const char *name;
+      uint64_t *penalty;
+   } penalties[] = {{"fill", &fill_cycles}, {"load_use", &load_use_penalty}, {"branch", &branch_penalty},
+                    {"jal", &jal_penalty}, {"jalr", &jalr_penalty}, {"memory", &memory_latency},
+                    {"trap", &trap_penalty}, {"mret", &mret_penalty}};
+   for (unsigned int i = 0; i < sizeof(penalties) / sizeof(penalties[0]); i++)
+   {
+      if (name == penalties[i].name)
+      {
+         *penalties[i].penalty = value;
+         return true;
+      }
+   }
+   return false;
+}
@@ -0,0 +1,133 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class for the cycle model of a classic 5-stage in-order pipeline
+
+**************************************************************** */
+
+#include <stdint.h>
+#include <string>
+
+using namespace std;
+
+// Timing behaviour of an instruction, determining which registers it reads and
+// which penalties apply to it
+enum timing_class
+{
+   tc_alu_rr, // reads rs1 and rs2
+   tc_alu_ri, // reads rs1
+   tc_upper,  // LUI and AUIPC, reads no registers
+   tc_load,
+   tc_store,
+   tc_atomic, // SC and AMOs, which read rs1 and rs2 and load into rd
+   tc_branch,
+   tc_jal,
+   tc_jalr,
+   tc_csr_r,  // CSR instruction with a register operand
+   tc_csr_i,  // CSR instruction with an immediate operand
+   tc_system, // ECALL, EBREAK and illegal instructions, which always trap
+   tc_mret
+};
+
+class pipeline_model
+{
+
+private:
+   // Penalties in cycles, configurable by name
+   uint64_t fill_cycles;          // filling the pipeline before the first instruction retires
+   uint64_t load_use_penalty;     // an instruction that uses the result of the load before it
+   uint64_t branch_penalty;       // a taken branch, resolved in EX
+   uint64_t jal_penalty;          // JAL, resolved in ID
+   uint64_t jalr_penalty;         // JALR, resolved in EX
+   uint64_t memory_latency;       // extra cycles for each data memory access
+   uint64_t trap_penalty;         // flushing the pipeline on an exception or interrupt
+   uint64_t mret_penalty;         // flushing the pipeline on MRET
+
+   uint64_t cycles;
+   bool started;
+   // Destination of the previous instruction if it was a load, or 0
+   unsigned int load_destination;
+
+public:
+   // Constructor
+   pipeline_model();
+
+   // Set a penalty from a "name=value" setting. Return false if the setting is not recognized.
+   bool configure(string setting);
+
+   // Account for an instruction retiring. redirected is set if the pipeline has to be redirected
+   // after it: a taken branch or a jump under static not-taken prediction, or a misprediction when
+   // a branch predictor is modelled.
+   void retire(timing_class cls, unsigned int rd, unsigned int rs1, unsigned int rs2, bool redirected)
+   {
+      if (!started)
+      {
+         cycles += fill_cycles;
+         started = true;
+      }
+      cycles++;
+      if (load_destination != 0)
+      {
+         bool reads_rs1 = cls != tc_upper && cls != tc_jal && cls != tc_csr_i && cls != tc_system && cls != tc_mret;
+         bool reads_rs2 = cls == tc_alu_rr || cls == tc_store || cls == tc_atomic || cls == tc_branch;
+         if ((reads_rs1 && rs1 == load_destination) || (reads_rs2 && rs2 == load_destination))
+         {
+            cycles += load_use_penalty;
+         }
+      }
+      load_destination = (cls == tc_load || cls == tc_atomic) ? rd : 0;
+      switch (cls)
+      {
+      case tc_load:
+      case tc_store:
+      case tc_atomic:
+         cycles += memory_latency;
+         break;
+      case tc_branch:
+         if (redirected)
+         {
+            cycles += branch_penalty;
+         }
+         break;
+      case tc_jal:
+         if (redirected)
+         {
+            cycles += jal_penalty;
+         }
+         break;
+      case tc_jalr:
+         if (redirected)
+         {
+            cycles += jalr_penalty;
+         }
+         break;
+      case tc_mret:
+         cycles += mret_penalty;
+         break;
+      default:
+         break;
+      }
+   }
+
+   // Account for an exception or interrupt being taken. A trapping instruction does not retire,
+   // but occupies the pipeline until the flush.
+   void trap()
+   {
+      cycles += 1 + trap_penalty;
+      load_destination = 0;
+   }
+
+   // Add stall cycles, for example from a cache miss
+   void stall(uint64_t stall_cycles)
+   {
+      cycles += stall_cycles;
+   }
+
+   uint64_t get_cycles() { return cycles; }
+};
+
+#endif
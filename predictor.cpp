@@ -0,0 +1,281 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class members for the branch predictor model
+
+**************************************************************** */
+
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <stdlib.h>
+
+#include "predictor.h"
+
+using namespace std;
+
+branch_predictor::branch_predictor()
+{
+   kind = bp_bimodal;
+   table_bits = 12;
+   history_bits = 12;
+   ras_depth = 16;
+   btb_bits = 9;
+   penalty = 2;
+   report_count = 10;
+   history = 0;
+   ras_top = 0;
+   conditional = 0;
+   conditional_mispredicted = 0;
+   returns = 0;
+   returns_mispredicted = 0;
+   indirect = 0;
+   indirect_mispredicted = 0;
+   direct = 0;
+   reset();
+}
+
+bool branch_predictor::configure(string setting)
+{
+   if (setting == "static")
+   {
+      kind = bp_static;
+      return true;
+   }
+   if (setting == "bimodal")
+   {
+      kind = bp_bimodal;
+      return true;
+   }
+   if (setting == "gshare")
+   {
+      kind = bp_gshare;
+      return true;
+   }
+   if (setting == "tournament")
+   {
+      kind = bp_tournament;
+      return true;
+   }
+
+   size_t equals = setting.find('=');
+   if (equals == string::npos || equals + 1 == setting.length())
+   {
+      cout << "Invalid branch predictor setting: " << setting << endl;
+      return false;
+   }
+   string name = setting.substr(0, equals);
+   char *end;
+   uint64_t value = strtoull(setting.c_str() + equals + 1, &end, 10);
+   if (*end != '\0')
+   {
+      cout << "Invalid branch predictor setting: " << setting << endl;
+      return false;
+   }
+   if ((name == "table" || name == "history" || name == "btb") && (value == 0 || value > 24))
+   {
+      cout << "Branch predictor " << name << " must be from 1 to 24 bits" << endl;
+      return false;
+   }
+   if (name == "table")
+   {
+      table_bits = value;
+   }
+   else if (name == "history")
+   {
+      history_bits = value;
+   }
+   else if (name == "btb")
+   {
+      btb_bits = value;
+   }
+   else if (name == "ras")
+   {
+      ras_depth = value;
+   }
+   else if (name == "penalty")
+   {
+      penalty = value;
+   }
+   else if (name == "top")
+   {
+      report_count = value;
+   }
+   else
+   {
+      cout << "Unknown branch predictor setting: " << name << endl;
+      return false;
+   }
+   return true;
+}
+
+void branch_predictor::reset()
+{
+   bimodal.assign(1 << table_bits, 1);
+   // gshare is indexed by pc and history together, so covers the longer of the two
+   gshare.assign(1 << max(table_bits, history_bits), 1);
+   chooser.assign(1 << table_bits, 1);
+   history = 0;
+   ras.assign(ras_depth, 0);
+   ras_top = 0;
+   btb.assign(1 << btb_bits, 0);
+   branches.clear();
+}
+
+void branch_predictor::train(uint8_t &counter, bool taken)
+{
+   if (taken && counter < 3)
+   {
+      counter++;
+   }
+   else if (!taken && counter > 0)
+   {
+      counter--;
+   }
+}
+
+// Tables are indexed by pc >> 1, as compressed instructions can start at any halfword
+bool branch_predictor::branch(uint64_t pc, bool taken)
+{
+   uint64_t index = (pc >> 1) & ((1ULL << table_bits) - 1);
+   uint64_t gshare_index = ((pc >> 1) ^ history) & (gshare.size() - 1);
+   bool bimodal_prediction = bimodal[index] >= 2;
+   bool gshare_prediction = gshare[gshare_index] >= 2;
+   bool prediction;
+   switch (kind)
+   {
+   case bp_static:
+      prediction = false;
+      break;
+   case bp_bimodal:
+      prediction = bimodal_prediction;
+      break;
+   case bp_gshare:
+      prediction = gshare_prediction;
+      break;
+   default:
+      prediction = chooser[index] >= 2 ? gshare_prediction : bimodal_prediction;
+      break;
+   }
+
+   if (kind == bp_tournament && bimodal_prediction != gshare_prediction)
+   {
+      train(chooser[index], gshare_prediction == taken);
+   }
+   train(bimodal[index], taken);
+   train(gshare[gshare_index], taken);
+   history = ((history << 1) | (taken ? 1 : 0)) & ((1ULL << history_bits) - 1);
+
+   bool mispredicted = prediction != taken;
+   branch_statistics &statistics = branches[pc];
+   statistics.executed++;
+   statistics.taken += taken ? 1 : 0;
+   statistics.mispredicted += mispredicted ? 1 : 0;
+   conditional++;
+   conditional_mispredicted += mispredicted ? 1 : 0;
+   return mispredicted;
+}
+
+void branch_predictor::push_return(uint64_t address)
+{
+   if (ras_depth == 0)
+   {
+      return;
+   }
+   ras[ras_top % ras_depth] = address;
+   ras_top++;
+}
+
+bool branch_predictor::predict_indirect(uint64_t pc, uint64_t target)
+{
+   uint64_t &entry = btb[(pc >> 1) & (btb.size() - 1)];
+   bool mispredicted = entry != target;
+   entry = target;
+   indirect++;
+   indirect_mispredicted += mispredicted ? 1 : 0;
+   return mispredicted;
+}
+
+// The link registers x1 and x5 mark calls and returns, as in the RISC-V calling convention hints
+bool branch_predictor::jump(uint64_t pc, unsigned int length, uint64_t target, bool indirect, unsigned int rd,
+                            unsigned int rs1)
+{
+   bool link = rd == 1 || rd == 5;
+   bool mispredicted = false;
+   if (!indirect)
+   {
+      direct++;
+   }
+   else if (!link && (rs1 == 1 || rs1 == 5))
+   {
+      // A return, predicted from the return address stack
+      returns++;
+      uint64_t predicted = 0;
+      if (ras_top > 0 && ras_depth > 0)
+      {
+         ras_top--;
+         predicted = ras[ras_top % ras_depth];
+      }
+      mispredicted = predicted != target;
+      returns_mispredicted += mispredicted ? 1 : 0;
+   }
+   else
+   {
+      mispredicted = predict_indirect(pc, target);
+   }
+   if (link)
+   {
+      push_return(pc + length);
+   }
+   return mispredicted;
+}
+
+static bool more_mispredicted(const pair<uint64_t, uint64_t> &a, const pair<uint64_t, uint64_t> &b)
+{
+   return a.second != b.second ? a.second > b.second : a.first < b.first;
+}
+
+void branch_predictor::print_statistics(const memory *main_memory)
+{
+   static const char *kind_names[] = {"static", "bimodal", "gshare", "tournament"};
+   uint64_t mispredicted = conditional_mispredicted + returns_mispredicted + indirect_mispredicted;
+   cout << "Branch predictor: " << kind_names[kind] << endl;
+   cout << "Conditional branches: " << dec << conditional << ", mispredicted " << conditional_mispredicted;
+   if (conditional != 0)
+   {
+      cout << " (" << fixed << setprecision(2) << 100.0 * (conditional - conditional_mispredicted) / conditional
+           << "% accuracy)";
+   }
+   cout << endl;
+   cout << "Returns: " << returns << ", mispredicted " << returns_mispredicted << endl;
+   cout << "Indirect jumps: " << indirect << ", mispredicted " << indirect_mispredicted << endl;
+   cout << "Direct jumps: " << direct << endl;
+   cout << "Misprediction penalty: " << mispredicted * penalty << " cycles" << endl;
+
+   vector<pair<uint64_t, uint64_t> > worst;
+   for (unordered_map<uint64_t, branch_statistics>::const_iterator i = branches.begin(); i != branches.end(); i++)
+   {
+      if (i->second.mispredicted != 0)
+      {
+         worst.push_back(make_pair(i->first, i->second.mispredicted));
+      }
+   }
+   sort(worst.begin(), worst.end(), more_mispredicted);
+   if (worst.size() > report_count)
+   {
+      worst.resize(report_count);
+   }
+   for (unsigned int i = 0; i < worst.size(); i++)
+   {
+      const branch_statistics &statistics = branches[worst[i].first];
+      cout << "  " << setw(16) << setfill('0') << hex << worst[i].first;
+      const memory::symbol *symbol = main_memory->find_symbol(worst[i].first);
+      if (symbol != NULL)
+      {
+         cout << " <" << symbol->name << "+0x" << worst[i].first - symbol->address << ">";
+      }
+      cout << dec << ": " << statistics.mispredicted << " mispredicted of " << statistics.executed << " executed, "
+           << statistics.taken << " taken" << endl;
+   }
+}
@@ -0,0 +1,97 @@
+#ifndef PREDICTOR_H
+#define PREDICTOR_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class for the branch predictor model
+
+**************************************************************** */
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "memory.h"
+
+using namespace std;
+
+enum predictor_kind
+{
+   bp_static, // always not taken
+   bp_bimodal,
+   bp_gshare,
+   bp_tournament
+};
+
+// Direction predictor for conditional branches, a branch target buffer for indirect jumps and
+// a return address stack for returns. Direct jumps are assumed to be predicted at decode.
+class branch_predictor
+{
+
+private:
+   predictor_kind kind;
+   unsigned int table_bits;
+   unsigned int history_bits;
+   unsigned int ras_depth;
+   unsigned int btb_bits;
+   uint64_t penalty;
+   unsigned int report_count;
+
+   // 2-bit saturating counters, 0 and 1 predicting not taken
+   vector<uint8_t> bimodal;
+   vector<uint8_t> gshare;
+   // Tournament chooser, 2 and 3 choosing gshare
+   vector<uint8_t> chooser;
+   uint64_t history;
+
+   vector<uint64_t> ras;
+   unsigned int ras_top; // number of valid entries, wrapping over the oldest
+   vector<uint64_t> btb;
+
+   struct branch_statistics
+   {
+      uint64_t executed;
+      uint64_t taken;
+      uint64_t mispredicted;
+   };
+   unordered_map<uint64_t, branch_statistics> branches;
+
+   uint64_t conditional;
+   uint64_t conditional_mispredicted;
+   uint64_t returns;
+   uint64_t returns_mispredicted;
+   uint64_t indirect;
+   uint64_t indirect_mispredicted;
+   uint64_t direct;
+
+   static void train(uint8_t &counter, bool taken);
+   void push_return(uint64_t address);
+   bool predict_indirect(uint64_t pc, uint64_t target);
+
+public:
+   // Constructor
+   branch_predictor();
+
+   // Configure from a predictor kind (static, bimodal, gshare or tournament) or a
+   // name=value setting (table, history, ras, btb, penalty or top). Print a message and
+   // return false if the setting is invalid.
+   bool configure(string setting);
+
+   // Allocate the tables once configured
+   void reset();
+
+   // Record the outcome of a conditional branch. Return true if it was mispredicted.
+   bool branch(uint64_t pc, bool taken);
+
+   // Record a JAL or JALR of length bytes to target. Return true if it was mispredicted.
+   bool jump(uint64_t pc, unsigned int length, uint64_t target, bool indirect, unsigned int rd, unsigned int rs1);
+
+   // Print the accuracy, the implied penalty and the branches mispredicted most often,
+   // named from the symbols in main_memory
+   void print_statistics(const memory *main_memory);
+};
+
+#endif
@@ -9,12 +9,21 @@
 #include <iostream>
 #include <iomanip>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 
 #include "memory.h"
 #include "processor.h"
+#include "compressed.h"
+#include "checkpoint.h"
+#include "clint.h"
 
 using namespace std;
 
+// Host 128-bit integers, for the high halves of products
+__extension__ typedef __int128 int128;
+__extension__ typedef unsigned __int128 uint128;
+
 processor::processor(memory *main_memory, bool verbose, bool stage2)
 {
    Main_Memory = main_memory;
@@ -24,28 +33,108 @@ processor::processor(memory *main_memory, bool verbose, bool stage2)
    prv = 3;
    pc = 0;
    instruction_count = 0;
+   for (int i = 0; i < 3; i++)
+   {
+      code_caches[i].last_page_address = 0;
+      code_caches[i].last_page = NULL;
+   }
+   code = &code_caches[0];
+   decode_generation = main_memory->get_code_generation();
+   translated_code_stale = false;
+   all_code_stale = false;
+   fetch_fault_address = 0;
+   timer = NULL;
+   timer_deadline = ~(uint64_t)0;
+   device_entry.tag = ~(uint64_t)0;
+   device_entry.host = NULL;
+   flush_translations();
+   block_mode = true;
+   stop_on_ecall = false;
+   stop_requested = false;
+   for (unsigned int i = 0; i < op_count; i++)
+   {
+      op_counts[i] = 0;
+   }
+   branches_taken = 0;
+   for (unsigned int i = 0; i < 16; i++)
+   {
+      trap_counts[i] = 0;
+      interrupt_counts[i] = 0;
+   }
+   timing = NULL;
+   caches = NULL;
+   predictor = NULL;
+   profile = NULL;
+   trace = NULL;
+   trap_taken = false;
    for (int i = 0; i < 32; i++)
    {
       registers[i] = 0;
    }
-   csr_register[0xF11] = 0x0000000000000000; 
-   csr_register[0xF12] = 0x0000000000000000; 
-   csr_register[0xF13] = 0x2024020000000000; 
-   csr_register[0xF14] = 0x0000000000000000; 
-   csr_register[0x300] = 0x0000000200000000; 
-   csr_register[0x301] = 0x8000000000100100; 
-   csr_register[0x304] = 0x0000000000000000; 
-   csr_register[0x305] = 0x0000000000000000; 
-   csr_register[0x340] = 0x0000000000000000; 
-   csr_register[0x341] = 0x0000000000000000; 
-   csr_register[0x342] = 0x0000000000000000; 
-   csr_register[0x343] = 0x0000000000000000; 
-   csr_register[0x344] = 0x0000000000000000;
+   for (int i = 0; i < 4096; i++)
+   {
+      csr_slot[i] = -1;
+   }
+   for (int i = 0; i < csr_count; i++)
+   {
+      csr_slot[csr_table[i].number] = i;
+      csr_register[i] = csr_table[i].reset_value;
+   }
+   update_interrupt_pending();
+   update_translation();
 }
 
+// Implemented CSRs, in the order of csr_id. Writes keep the bits in write_mask and then set
+// the bits in set_bits, except for mtvec and stvec whose masks depend on the mode written.
+const processor::csr_description processor::csr_table[csr_count] = {
+    // number, reset value,     write mask,          set bits,            read-only, view of
+    {0xF11, 0x0000000000000000, 0x0000000000000000, 0x0000000000000000, true, csr_count},  // mvendorid
+    {0xF12, 0x0000000000000000, 0x0000000000000000, 0x0000000000000000, true, csr_count},  // marchid
+    {0xF13, 0x2024020000000000, 0x0000000000000000, 0x0000000000000000, true, csr_count},  // mimpid
+    {0xF14, 0x0000000000000000, 0x0000000000000000, 0x0000000000000000, true, csr_count},  // mhartid
+    {0x300, 0x0000000a00000000, 0x00000000000e19aa, 0x0000000a00000000, false, csr_count}, // mstatus
+    {0x301, 0x8000000000141105, 0x0000000000000000, 0x8000000000141105, false, csr_count}, // misa
+    {0x304, 0x0000000000000000, 0x0000000000000bbb, 0x0000000000000000, false, csr_count}, // mie
+    {0x305, 0x0000000000000000, 0xfffffffffffffffc, 0x0000000000000000, false, csr_count}, // mtvec
+    {0x340, 0x0000000000000000, 0xffffffffffffffff, 0x0000000000000000, false, csr_count}, // mscratch
+    {0x341, 0x0000000000000000, 0xfffffffffffffffe, 0x0000000000000000, false, csr_count}, // mepc
+    {0x342, 0x0000000000000000, 0x800000000000000f, 0x0000000000000000, false, csr_count}, // mcause
+    {0x343, 0x0000000000000000, 0xffffffffffffffff, 0x0000000000000000, false, csr_count}, // mtval
+    {0x344, 0x0000000000000000, 0x0000000000000bbb, 0x0000000000000000, false, csr_count}, // mip
+    {0x302, 0x0000000000000000, 0x000000000000b3ff, 0x0000000000000000, false, csr_count}, // medeleg
+    {0x303, 0x0000000000000000, 0x0000000000000222, 0x0000000000000000, false, csr_count}, // mideleg
+    {0x100, 0x0000000000000000, 0x00000000000c0122, 0x0000000300000000, false, csr_mstatus}, // sstatus
+    {0x104, 0x0000000000000000, 0x0000000000000222, 0x0000000000000000, false, csr_mie},     // sie
+    {0x105, 0x0000000000000000, 0xfffffffffffffffc, 0x0000000000000000, false, csr_count},   // stvec
+    {0x140, 0x0000000000000000, 0xffffffffffffffff, 0x0000000000000000, false, csr_count},   // sscratch
+    {0x141, 0x0000000000000000, 0xfffffffffffffffe, 0x0000000000000000, false, csr_count},   // sepc
+    {0x142, 0x0000000000000000, 0x800000000000000f, 0x0000000000000000, false, csr_count},   // scause
+    {0x143, 0x0000000000000000, 0xffffffffffffffff, 0x0000000000000000, false, csr_count},   // stval
+    {0x144, 0x0000000000000000, 0x0000000000000002, 0x0000000000000220, false, csr_mip},     // sip
+    {0x180, 0x0000000000000000, 0x80000fffffffffff, 0x0000000000000000, false, csr_count}    // satp
+};
+
+// mstatus fields
+static const uint64_t mstatus_sie = 0x2;
+static const uint64_t mstatus_spie = 0x20;
+static const uint64_t mstatus_spp = 0x100;
+static const uint64_t mstatus_mpp = 0x1800;
+static const uint64_t mstatus_mprv = 0x20000;
+static const uint64_t mstatus_sum = 0x40000;
+static const uint64_t mstatus_mxr = 0x80000;
+
+// Sv39 page table entry bits
+static const uint64_t pte_v = 0x1;
+static const uint64_t pte_r = 0x2;
+static const uint64_t pte_w = 0x4;
+static const uint64_t pte_x = 0x8;
+static const uint64_t pte_u = 0x10;
+static const uint64_t pte_a = 0x40;
+static const uint64_t pte_d = 0x80;
+
 bool processor::csr_check(uint16_t csr_num)
 {
-   return csr_register.find(csr_num) != csr_register.end();
+   return csr_num < 4096 && csr_slot[csr_num] >= 0;
 }
 
 void processor::show_pc()
@@ -81,6 +170,11 @@ void processor::set_breakpoint(uint64_t address)
    breakpoint = address;
 }
 
+void processor::set_hart_id(uint64_t id)
+{
+   csr_register[csr_mhartid] = id;
+}
+
 void processor::show_prv()
 {
    switch (prv)
@@ -88,6 +182,9 @@ void processor::show_prv()
    case 0:
       cout << "0 (user)" << endl;
       break;
+   case 1:
+      cout << "1 (supervisor)" << endl;
+      break;
    case 3:
       cout << "3 (machine)" << endl;
       break;
@@ -96,9 +193,11 @@ void processor::show_prv()
 
 void processor::set_prv(unsigned int prv_num)
 {
-   if (prv_num == 0 || prv_num == 3)
+   if (prv_num == 0 || prv_num == 1 || prv_num == 3)
    {
       prv = prv_num;
+      update_interrupt_pending();
+      update_translation();
    }
 }
 
@@ -106,7 +205,7 @@ void processor::show_csr(unsigned int csr_num)
 {
    if (csr_check(csr_num))
    {
-      cout << setw(16) << setfill('0') << hex << csr_register[csr_num] << endl;
+      cout << setw(16) << setfill('0') << hex << read_csr(csr_slot[csr_num]) << endl;
    }
    else
    {
@@ -118,48 +217,51 @@ void processor::set_csr(unsigned int csr_num, uint64_t new_value)
 {
    if (csr_check(csr_num))
    {
-      if (csr_num == 0xF11 || csr_num == 0xF12 || csr_num == 0xF13 || csr_num == 0xF14)
+      const csr_description &csr = csr_table[csr_slot[csr_num]];
+      if (csr.read_only)
       {
          cout << "Illegal write to read-only CSR" << endl;
          return;
       }
-      switch (csr_num)
+      if (csr_num == 0x180 && (new_value >> 60) != 0 && (new_value >> 60) != 8)
       {
-      case 0x300:
-         new_value &= 0x0000000000001888;
-         new_value |= 0x0000000200000000;
-         break;
-      case 0x301:
-         new_value = 0x8000000000100100;
-         break;
-      case 0x304:
-         new_value &= 0x0000000000000999;
-         break;
-      case 0x305:
-         if (new_value & 0x1)
-         {
-            new_value &= 0xffffffffffffff01;
-         }
-         else
-         {
-            new_value &= 0xfffffffffffffffc;
-         }
-         break;
-      case 0x340:
-         break;
-      case 0x341:
-         new_value &= 0xfffffffffffffffc;
-         break;
-      case 0x342:
-         new_value &= 0x800000000000000f;
-         break;
-      case 0x343:
-         break;
-      case 0x344:
-         new_value &= 0x0000000000000999;
-         break;
+         // Only Bare and Sv39 are supported, and a write selecting another mode is ignored
+         return;
+      }
+      if (csr_num == 0x300 && ((new_value >> 11) & 3) == 2)
+      {
+         // There is no privilege level 2, so MPP keeps its value
+         new_value = (new_value & ~mstatus_mpp) | (csr_register[csr_mstatus] & mstatus_mpp);
+      }
+      if (csr.view != csr_count)
+      {
+         // A view changes only its writable bits of the CSR it shows
+         uint64_t &viewed = csr_register[csr.view];
+         viewed = (viewed & ~csr.write_mask) | (new_value & csr.write_mask);
+      }
+      else if ((csr_num == 0x305 || csr_num == 0x105) && (new_value & 0x1))
+      {
+         // Vectored mode requires a 256-byte aligned base
+         csr_register[csr_slot[csr_num]] = new_value & 0xffffffffffffff01;
+      }
+      else
+      {
+         csr_register[csr_slot[csr_num]] = (new_value & csr.write_mask) | csr.set_bits;
+      }
+      if (csr_num == 0x300 || csr_num == 0x304 || csr_num == 0x344 || csr_num == 0x303 || csr_num == 0x100 ||
+          csr_num == 0x104 || csr_num == 0x144)
+      {
+         update_interrupt_pending();
+      }
+      if (csr_num == 0x300 || csr_num == 0x100)
+      {
+         update_translation();
+      }
+      else if (csr_num == 0x180)
+      {
+         flush_translations();
+         update_translation();
       }
-      csr_register[csr_num] = new_value;
    }
    else
    {
@@ -168,1036 +270,2216 @@ void processor::set_csr(unsigned int csr_num, uint64_t new_value)
    return;
 }
 
-void processor::exception_handling(uint32_t cause, uint64_t instruction)
+uint64_t processor::read_csr(int slot)
 {
-   set_csr(0x341, pc);
-   set_csr(0x342, cause);
-   uint64_t PC = pc;
-   set_pc((csr_register[0x305] & 0xfffffffffffffffc) - 4);
-
-   uint64_t mie = (csr_register[0x300] >> 3) & 1;
-   set_csr(0x300, csr_register[0x300] & 0xFFFFFFFFFFFFE777);
-   set_csr(0x300, csr_register[0x300] | (prv << 11 | mie << 7));
-   instruction_count--;
-
-   switch (cause)
-   {
-   case 0:
+   const csr_description &csr = csr_table[slot];
+   if (csr.view != csr_count)
    {
-      set_csr(0x343, PC);
-      instruction_count++;
-      pc += 4;
+      return csr_register[csr.view] & (csr.write_mask | csr.set_bits);
    }
-   break;
-   case 2:
+   return csr_register[slot];
+}
+
+void processor::exception_handling(uint32_t cause, uint64_t value, unsigned int length)
+{
+   trap_counts[cause & 15]++;
+   trap_taken = true;
+   if (timing != NULL)
    {
-      set_csr(0x343, instruction);
+      timing->trap();
    }
-   break;
-   case 4:
+   if (length != 0)
    {
-      uint64_t rs1 = (instruction & 0x000F8000) >> 15;
-      int64_t imm = ((int64_t)(int32_t)instruction) >> 20;
-      set_csr(0x343, registers[rs1] + imm);
+      instruction_count--;
    }
-   break;
-   case 6:
+   if (prv != 3 && ((csr_register[csr_medeleg] >> cause) & 1))
    {
-
-      uint64_t rs1 = (instruction & 0x000F8000) >> 15;
-      uint64_t imm2 = (instruction & 0x00000F80) >> 7;
-      uint64_t imm = ((int64_t)(int32_t)instruction) >> 25;
-      imm = (imm << 5) + imm2;
-      set_csr(0x343, registers[rs1] + imm);
+      set_pc(supervisor_trap(cause, value) - length);
+      return;
    }
-   break;
-   case 8:
-   case 11:
+   set_csr(0x341, pc);
+   set_csr(0x342, cause);
+   set_csr(0x343, value);
+   set_pc((csr_register[csr_mtvec] & 0xfffffffffffffffc) - length);
+
+   uint64_t mie = (csr_register[csr_mstatus] >> 3) & 1;
+   set_csr(0x300, csr_register[csr_mstatus] & 0xFFFFFFFFFFFFE777);
+   set_csr(0x300, csr_register[csr_mstatus] | (prv << 11 | mie << 7));
+   // Traps other than ECALL have always left a user mode hart in user mode, and existing
+   // programs expect that. With paging on that would run the handler through the user's page
+   // table, so there every trap enters machine mode.
+   if (cause == 8 || cause == 9 || cause == 11 || prv != 0 || fetch_translated)
    {
       prv = 3;
-      set_csr(0x343, 0x0000000000000000);
+      update_interrupt_pending();
+      update_translation();
    }
-   break;
+}
+
+// Enter supervisor mode for a delegated trap, recording it in sepc, scause and stval, and
+// return the address of the handler
+uint64_t processor::supervisor_trap(uint64_t cause, uint64_t value)
+{
+   csr_register[csr_sepc] = pc & ~(uint64_t)1;
+   csr_register[csr_scause] = cause;
+   csr_register[csr_stval] = value;
+   uint64_t mstatus = csr_register[csr_mstatus];
+   uint64_t sie = (mstatus & mstatus_sie) != 0;
+   mstatus &= ~(mstatus_sie | mstatus_spie | mstatus_spp);
+   csr_register[csr_mstatus] = mstatus | (sie << 5) | (prv << 8);
+   prv = 1;
+   update_interrupt_pending();
+   update_translation();
+   uint64_t stvec = csr_register[csr_stvec];
+   if ((stvec & 1) && (cause >> 63))
+   {
+      return (stvec & 0xfffffffffffffffc) + 4 * (cause & 63);
    }
+   return stvec & 0xfffffffffffffffc;
 }
 
 void processor::interrupt(uint32_t cause)
 {
-   set_csr(0x300, csr_register[0x300] | 0x0000000000000080);
+   interrupt_counts[cause & 15]++;
+   if (timing != NULL)
+   {
+      timing->trap();
+   }
+   if (prv != 3 && ((csr_register[csr_mideleg] >> cause) & 1))
+   {
+      set_pc(supervisor_trap(0x8000000000000000 + cause, 0));
+      return;
+   }
    set_csr(0x341, pc);
    set_csr(0x342, 0x8000000000000000 + cause);
-   if (csr_register[0x305] & 0x0000000000000001)
+   if (csr_register[csr_mtvec] & 0x0000000000000001)
    {
-      set_pc((csr_register[0x305] & 0xfffffffffffffffc) + (4 * cause));
+      set_pc((csr_register[csr_mtvec] & 0xfffffffffffffffc) + (4 * cause));
    }
    else
    {
-      set_pc(csr_register[0x305] & 0xfffffffffffffffc);
+      set_pc(csr_register[csr_mtvec] & 0xfffffffffffffffc);
    }
-   uint64_t mstatus = csr_register[0x300];
-   if (prv == 0)
+   uint64_t mstatus = csr_register[csr_mstatus];
+   uint64_t mie = (mstatus >> 3) & 1;
+   mstatus &= 0xffffffffffffe777;
+   mstatus |= (prv << 11) | (mie << 7);
+   prv = 3;
+   set_csr(0x300, mstatus);
+}
+
+// Interrupts that are pending, enabled in mie and enabled at the current privilege level.
+// Interrupts delegated by mideleg are taken in supervisor mode, and the rest in machine mode.
+uint64_t processor::enabled_interrupts()
+{
+   uint64_t pending = csr_register[csr_mie] & csr_register[csr_mip];
+   uint64_t delegated = csr_register[csr_mideleg];
+   uint64_t mstatus = csr_register[csr_mstatus];
+   uint64_t enabled = 0;
+   if (prv != 3 || (mstatus & 0x8))
    {
-      mstatus &= 0xffffffffffffe7ff;
-      if (!(mstatus & 0x0000000000000008))
-      {
-         mstatus &= 0xffffffffffffff7f;
-      }
-      prv = 3;
+      enabled |= pending & ~delegated;
    }
-   else if (prv == 3)
+   if (prv == 0 || (prv == 1 && (mstatus & mstatus_sie)))
    {
-      mstatus |= 0x0000000000001800;
+      enabled |= pending & delegated;
    }
-   set_csr(0x300, mstatus & 0xfffffffffffffff7);
+   return enabled;
 }
 
-void processor::execute(unsigned int num, bool breakpoint_check)
+// Recompute whether an enabled interrupt is pending, so that execute only needs to test
+// interrupt_pending. Must be called whenever mstatus, mie, mip, mideleg or prv changes.
+void processor::update_interrupt_pending()
 {
-   for (unsigned int i = 0; i < num; i++)
+   interrupt_pending = enabled_interrupts() != 0;
+}
+
+// Take the highest priority interrupt that is pending and enabled
+void processor::take_pending_interrupt()
+{
+   static const unsigned int priority[] = {11, 3, 7, 9, 1, 5, 8, 0, 4};
+   uint64_t enabled = enabled_interrupts();
+   for (unsigned int i = 0; i < sizeof(priority) / sizeof(priority[0]); i++)
    {
-      if (breakpoint_check && (pc == breakpoint))
+      if ((enabled >> priority[i]) & 1)
       {
-         cout << "Breakpoint reached at ";
-         cout << setw(16) << setfill('0') << hex << breakpoint << endl;
-         break;
+         interrupt(priority[i]);
+         return;
+      }
+   }
+}
+
+bool processor::execute(unsigned int num, bool breakpoint_check)
+{
+   stop_requested = false;
+   // A halted machine runs no further
+   if (Main_Memory->is_halted())
+   {
+      return true;
+   }
+   bool observed = timing != NULL || caches != NULL || predictor != NULL || trace != NULL;
+   bool profiled = profile != NULL;
+   if (block_mode)
+   {
+      if (!observed && !profiled)
+      {
+         return execute_blocks<false, false>(num, breakpoint_check);
       }
-      if ((csr_register[0x300] & 0x8) || (prv == 0))
+      else if (!observed)
       {
-         if ((csr_register[0x304] & 0x800) && (csr_register[0x344] & 0x800))
-         {
-            interrupt(11);
-         }
-         else if ((csr_register[0x304] & 0x8) && (csr_register[0x344] & 0x8))
-         {
-            interrupt(3);
-         }
-         else if ((csr_register[0x304] & 0x80) && (csr_register[0x344] & 0x80))
-         {
-            interrupt(7);
-         }
-         else if ((csr_register[0x304] & 0x100) && (csr_register[0x344] & 0x100))
-         {
-            interrupt(8);
-         }
-         else if ((csr_register[0x304] & 0x1) && (csr_register[0x344] & 0x1))
-         {
-            interrupt(0);
-         }
-         else if ((csr_register[0x304] & 0x10) && (csr_register[0x344] & 0x10))
-         {
-            interrupt(4);
-         }
+         return execute_blocks<false, true>(num, breakpoint_check);
       }
-      if (pc % 4 != 0)
+      else if (!profiled)
       {
-         exception_handling(0, 0);
-         continue;
+         return execute_blocks<true, false>(num, breakpoint_check);
       }
-      uint32_t instruction;
-      uint64_t buffer = Main_Memory->read_doubleword(pc);
-      curr_inst = buffer;
-      if (pc % 8 == 4)
+      else
       {
-         buffer = buffer >> 32;
+         return execute_blocks<true, true>(num, breakpoint_check);
+      }
+   }
+   else
+   {
+      if (!observed && !profiled)
+      {
+         return execute_instructions<false, false>(num, breakpoint_check);
+      }
+      else if (!observed)
+      {
+         return execute_instructions<false, true>(num, breakpoint_check);
+      }
+      else if (!profiled)
+      {
+         return execute_instructions<true, false>(num, breakpoint_check);
+      }
+      else
+      {
+         return execute_instructions<true, true>(num, breakpoint_check);
       }
-      instruction = buffer;
-      execute_instruction(instruction);
-      instruction_count++;
-      pc += 4;
    }
 }
 
-void processor::execute_instruction(uint32_t instruction)
+// Pass an executed instruction to the attached cycle, cache and branch predictor models and
+// the trace
+void processor::observe(const decoded_instruction &d, uint64_t instruction_pc, uint64_t data_address)
 {
-   uint32_t opcode = instruction & 0x0000007F;
-   uint32_t funct3 = (instruction & 0x00007000) >> 12;
-   uint16_t funct7;
-   uint8_t rd;
-   uint8_t rs1;
-   uint8_t rs2;
-   int64_t imm;
-
-   switch (opcode)
+   timing_class cls = timing_classes[d.op];
+   unsigned int length = instruction_length(d);
+   bool redirected = pc != instruction_pc + length;
+   if (predictor != NULL && !trap_taken)
    {
-   case 0b1100111:
+      if (cls == tc_branch)
+      {
+         redirected = predictor->branch(instruction_pc, redirected);
+      }
+      else if (cls == tc_jal || cls == tc_jalr)
+      {
+         redirected = predictor->jump(instruction_pc, length, pc, cls == tc_jalr, d.rd, d.rs1);
+      }
+   }
+   uint64_t stall_cycles = 0;
+   if (caches != NULL)
    {
-      switch (funct3)
+      stall_cycles += caches->fetch(instruction_pc);
+      if (!trap_taken && cls == tc_load)
       {
-      case 0b000:
+         stall_cycles += caches->load(data_address);
+      }
+      else if (!trap_taken && (cls == tc_store || cls == tc_atomic))
       {
-         rd = (instruction & 0x00000F80) >> 7;
-         rs1 = (instruction & 0x000F8000) >> 15;
-         imm = ((int64_t)(int32_t)instruction) >> 20;
-         uint64_t targetAddress = imm + registers[rs1];
-         targetAddress &= ~1;
-         set_reg(rd, pc + 4);
-         set_pc(targetAddress - 4);
+         stall_cycles += caches->store(data_address);
       }
-      break;
-      default:
-         exception_handling(2, instruction);
-         break;
+   }
+   if (timing != NULL)
+   {
+      if (!trap_taken)
+      {
+         timing->retire(cls, d.rd, d.rs1, d.rs2, redirected);
       }
-      break;
+      timing->stall(stall_cycles);
    }
-   case 0b0110111:
+   if (trace != NULL)
    {
-      rd = (instruction & 0x00000F80) >> 7;
-      registers[rd] = (int64_t)(int32_t)(instruction & 0xFFFFF000);
+      trace_instruction(d, instruction_pc, data_address);
    }
-   break;
-   case 0b0010111:
+}
+
+// Record an executed instruction in the trace
+void processor::trace_instruction(const decoded_instruction &d, uint64_t instruction_pc, uint64_t data_address)
+{
+   // Access size of each load and store, as log2 of the bytes, in the order of decoded_op
+   static const uint8_t access_sizes[] = {0, 1, 2, 3, 0, 1, 2, 0, 1, 2, 3};
+   timing_class cls = timing_classes[d.op];
+   trace_record r;
+   r.pc = instruction_pc;
+   r.instruction = d.raw;
+   r.trapped = trap_taken;
+   r.writes_register = !trap_taken && d.rd != 0 && cls != tc_branch && cls != tc_store && cls != tc_system &&
+                       cls != tc_mret;
+   r.rd = d.rd;
+   r.rd_value = registers[d.rd];
+   // An SC is recorded as a store if it succeeded (or its result is discarded), and an AMO as a
+   // load of the old value into rd
+   bool conditional = d.op == op_sc_w || d.op == op_sc_d;
+   r.accesses_memory = !trap_taken && (cls == tc_load || cls == tc_store || cls == tc_atomic) &&
+                       !(conditional && registers[d.rd] != 0);
+   r.store = cls == tc_store || conditional;
+   r.size_log2 = 0;
+   if (r.accesses_memory)
    {
-      rd = (instruction & 0x00000F80) >> 7;
-      set_reg(rd, (int64_t)(pc) + (int64_t)((int32_t)(instruction & 0xFFFFF000)));
+      bool word = d.op == op_lr_w || d.op == op_sc_w || (d.op >= op_amoswap_w && d.op <= op_amomaxu_w);
+      r.size_log2 = d.op >= op_lr_w ? (word ? 2 : 3) : access_sizes[d.op - op_lb];
    }
-   break;
-   case 0b0010011:
-      switch (funct3)
-      {
-      case 0b000:
+   r.address = data_address;
+   r.data = 0;
+   if (r.accesses_memory)
+   {
+      // The value loaded, as extended into rd, or the bytes stored
+      uint64_t mask = r.size_log2 == 3 ? ~(uint64_t)0 : (1ULL << (8 << r.size_log2)) - 1;
+      r.data = r.store ? registers[d.rs2] & mask : registers[d.rd];
+      if (conditional)
       {
-         rd = (instruction & 0x00000F80) >> 7;
-         rs1 = (instruction & 0x000F8000) >> 15;
-         imm = ((int64_t)(int32_t)instruction) >> 20;
-         set_reg(rd, registers[rs1] + imm);
+         // rs2 may be the register the result was written to, so read the value stored back
+         uint64_t physical = data_address;
+         if (data_translated)
+         {
+            physical = translate(data_address, access_store)->physical | (data_address & 2047);
+         }
+         r.data = Main_Memory->read64(physical & ~7ULL) >> (8 * (physical & 7)) & mask;
       }
-      break;
-      case 0b111:
+   }
+   trace->record(r);
+}
+
+// Pass a JAL or JALR that links through x1 or x5, or a JALR returning through them, to the profiler
+void processor::profile_jump(const decoded_instruction &d)
+{
+   if (d.rd == 1 || d.rd == 5)
+   {
+      profile->call(pc);
+   }
+   else if (d.op == op_jalr && d.rd == 0 && (d.rs1 == 1 || d.rs1 == 5))
+   {
+      profile->ret();
+   }
+}
+
+// Execute a number of instructions one at a time.
+// With observed set, each instruction is passed to the attached models, and with profiled set,
+// to the profiler. The instantiations without them leave them out entirely.
+template <bool observed, bool profiled>
+bool processor::execute_instructions(unsigned int num, bool breakpoint_check)
+{
+   for (unsigned int i = 0; i < num; i++)
+   {
+      if (breakpoint_check && (pc == breakpoint))
       {
-         rd = (instruction & 0x00000F80) >> 7;
-         rs1 = (instruction & 0x000F8000) >> 15;
-         imm = ((int64_t)(int32_t)instruction) >> 20;
-         set_reg(rd, registers[rs1] & imm);
+         cout << "Breakpoint reached at ";
+         cout << setw(16) << setfill('0') << hex << breakpoint << endl;
+         return true;
       }
-      break;
-      case 0b001:
+      if ((uint64_t)instruction_count >= timer_deadline.load(memory_order_relaxed))
       {
-         rd = (instruction & 0x00000F80) >> 7;
-         rs1 = (instruction & 0x000F8000) >> 15;
-         uint64_t shamt = (instruction >> 20) & 0x03F;
-         set_reg(rd, registers[rs1] << shamt);
+         update_timer();
       }
-      break;
-      case 0b110:
+      if (interrupt_pending)
       {
-         rd = (instruction & 0x00000F80) >> 7;
-         rs1 = (instruction & 0x000F8000) >> 15;
-         imm = ((int64_t)(int32_t)instruction) >> 20;
-         set_reg(rd, registers[rs1] | imm);
+         take_pending_interrupt();
       }
-      break;
-      case 0b010:
+      if (pc % 2 != 0)
       {
-         rd = (instruction & 0x00000F80) >> 7;
-         rs1 = (instruction & 0x000F8000) >> 15;
-         imm = ((int64_t)(int32_t)instruction) >> 20;
-         if ((int64_t)registers[rs1] < imm)
-         {
-            set_reg(rd, 1);
-         }
-         else
-         {
-            set_reg(rd, 0);
-         }
+         exception_handling(0, pc, 0);
+         continue;
       }
-      break;
-      case 0b011:
+      const decoded_instruction *fetched = fetch_decoded(pc);
+      if (fetched == NULL)
       {
-         rd = (instruction & 0x00000F80) >> 7;
-         rs1 = (instruction & 0x000F8000) >> 15;
-         imm = ((int64_t)(int32_t)instruction) >> 20;
-         if (registers[rs1] < (uint64_t)imm)
-         {
-            set_reg(rd, 1);
-         }
-         else
-         {
-            set_reg(rd, 0);
-         }
+         exception_handling(12, fetch_fault_address, 0);
+         continue;
       }
-      break;
-      case 0b100:
+      const decoded_instruction &d = *fetched;
+      uint64_t instruction_pc = pc;
+      unsigned int length = instruction_length(d);
+      uint64_t data_address = 0;
+      if (observed)
       {
-         rd = (instruction & 0x00000F80) >> 7;
-         rs1 = (instruction & 0x000F8000) >> 15;
-         imm = ((int64_t)(int32_t)instruction) >> 20;
-         set_reg(rd, registers[rs1] ^ imm);
+         trap_taken = false;
+         data_address = registers[d.rs1] + d.imm;
       }
-      break;
-      case 0b101:
+      d.handler(*this, d);
+      instruction_count++;
+      pc += length;
+      op_counts[d.op]++;
+      if (d.op >= op_beq && d.op <= op_bgeu && pc != instruction_pc + length)
       {
-         rd = (instruction & 0x00000F80) >> 7;
-         rs1 = (instruction & 0x000F8000) >> 15;
-         imm = ((int64_t)(int32_t)instruction) >> 20;
-         funct7 = (instruction & 0xFC000000) >> 25;
-         int64_t shamt = ((instruction >> 20) & 0x3F);
-         switch (funct7)
-         {
-         case 0b0000000:
-         {
-            set_reg(rd, registers[rs1] >> shamt);
-            break;
-         case 0b0100000:
-            set_reg(rd, (int64_t)registers[rs1] >> shamt);
-            break;
-         default:
-            exception_handling(2, instruction);
-            break;
-         }
-         break;
-         }
-         break;
-      }
-      break;
-      default:
-         exception_handling(2, instruction);
-         break;
+         branches_taken++;
       }
-      break;
-   case 0b0110011:
-      switch (funct3)
+      if (observed)
       {
-      case 0b000:
+         observe(d, instruction_pc, data_address);
+      }
+      if (profiled)
       {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rs2 = (instruction & 0x01F00000) >> 20;
-         rd = (instruction & 0x00000F80) >> 7;
-         funct7 = (instruction & 0xFE000000) >> 25;
-         switch (funct7)
+         profile->retire(instruction_pc, 1);
+         if (d.op == op_jal || d.op == op_jalr)
          {
-         case 0b0000000:
-            set_reg(rd, registers[rs1] + registers[rs2]);
-            break;
-         case 0b0100000:
-            set_reg(rd, registers[rs1] - registers[rs2]);
-            break;
-         default:
-            exception_handling(2, instruction);
-            break;
+            profile_jump(d);
          }
       }
-      break;
-      case 0b111:
+      if (stop_requested)
       {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rs2 = (instruction & 0x01F00000) >> 20;
-         rd = (instruction & 0x00000F80) >> 7;
-         set_reg(rd, registers[rs1] & registers[rs2]);
+         return true;
       }
-      break;
-      case 0b110:
+   }
+   return false;
+}
+
+// Execute a number of instructions a translated block at a time.
+// Blocks end at every instruction that can change the interrupt state and are cut short
+// before the breakpoint, so only the first instruction of a block can be the breakpoint or
+// have an interrupt pending. The per-instruction breakpoint check and interrupt test are
+// therefore done once per block, with the same results as executing one at a time.
+template <bool observed, bool profiled>
+bool processor::execute_blocks(unsigned int num, bool breakpoint_check)
+{
+   translated_block *block = NULL;
+   unsigned int i = 0;
+   while (i < num)
+   {
+      if (breakpoint_check && (pc == breakpoint))
       {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rs2 = (instruction & 0x01F00000) >> 20;
-         rd = (instruction & 0x00000F80) >> 7;
-         set_reg(rd, registers[rs1] | registers[rs2]);
+         cout << "Breakpoint reached at ";
+         cout << setw(16) << setfill('0') << hex << breakpoint << endl;
+         return true;
       }
-      break;
-      case 0b100:
+      if ((uint64_t)instruction_count >= timer_deadline.load(memory_order_relaxed))
       {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rs2 = (instruction & 0x01F00000) >> 20;
-         rd = (instruction & 0x00000F80) >> 7;
-         set_reg(rd, registers[rs1] ^ registers[rs2]);
+         update_timer();
       }
-      break;
-      case 0b001:
+      if (interrupt_pending)
       {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rs2 = (instruction & 0x01F00000) >> 20;
-         rd = (instruction & 0x00000F80) >> 7;
-         set_reg(rd, registers[rs1] << (registers[rs2] & 0x3F));
+         take_pending_interrupt();
       }
-      break;
-      case 0b010:
+      if (pc % 2 != 0)
+      {
+         exception_handling(0, pc, 0);
+         i++;
+         block = NULL;
+         continue;
+      }
+      if (block == NULL || block->start != pc)
       {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rs2 = (instruction & 0x01F00000) >> 20;
-         rd = (instruction & 0x00000F80) >> 7;
-         if ((int64_t)registers[rs1] < (int64_t)registers[rs2])
+         block = lookup_block(pc);
+         if (block == NULL)
          {
-            set_reg(rd, 1);
+            exception_handling(12, fetch_fault_address, 0);
+            i++;
+            continue;
          }
-         else
+      }
+      code_cache *block_code = code;
+
+      // Stop at the timer deadline, for the interrupt to be taken at the same instruction as
+      // when executing one at a time
+      uint64_t length = block->instructions.size();
+      uint64_t until_timer = timer_deadline.load(memory_order_relaxed) - instruction_count;
+      if (length > num - i)
+      {
+         length = num - i;
+      }
+      if (length > until_timer)
+      {
+         length = until_timer;
+      }
+      if (breakpoint_check && breakpoint > pc && breakpoint < block->end)
+      {
+         // Stop before the instruction at the breakpoint
+         uint64_t address = pc;
+         uint64_t before = 0;
+         while (before < length && address < breakpoint)
          {
-            set_reg(rd, 0);
+            address += instruction_length(block->instructions[before]);
+            before++;
          }
+         length = before;
       }
-      break;
-      case 0b011:
+      const decoded_instruction *first = block->instructions.data();
+      const decoded_instruction *last = first + length;
+      const decoded_instruction *d = first;
+      uint64_t block_pc = pc;
+      uint64_t next_pc = pc;
+      while (d != last)
       {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rs2 = (instruction & 0x01F00000) >> 20;
-         rd = (instruction & 0x00000F80) >> 7;
-         if (registers[rs1] < registers[rs2])
+         uint64_t data_address = 0;
+         if (observed)
          {
-            set_reg(rd, 1);
+            trap_taken = false;
+            data_address = registers[d->rs1] + d->imm;
          }
-         else
+         unsigned int step = instruction_length(*d);
+         d->handler(*this, *d);
+         instruction_count++;
+         pc += step;
+         next_pc += step;
+         if (observed)
          {
-            set_reg(rd, 0);
+            observe(*d, next_pc - step, data_address);
          }
-      }
-      break;
-      case 0b101:
-      {
-         rd = (instruction & 0x00000F80) >> 7;
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rs2 = (instruction & 0x01F00000) >> 20;
-         funct7 = (instruction & 0xFE000000) >> 25;
-         switch (funct7)
+         d++;
+         // Leave the block early on a trap, or on a write to decoded code
+         if (pc != next_pc || Main_Memory->get_code_generation() != decode_generation)
          {
-         case 0b0000000:
-            set_reg(rd, registers[rs1] >> (registers[rs2] & 0x3F));
-            break;
-         case 0b0100000:
-            set_reg(rd, (int64_t)registers[rs1] >> (registers[rs2] & 0x3F));
-            break;
-         default:
-            exception_handling(2, instruction);
             break;
          }
       }
-      break;
-      default:
-         exception_handling(2, instruction);
-         break;
-      }
-      break;
-   case 0b1100011:
-      switch (funct3)
+      i += d - first;
+      if (d == first + block->instructions.size())
       {
-      case 0b001:
+         block->runs++;
+         if (pc == block->taken_pc)
+         {
+            block->taken_runs++;
+         }
+      }
+      else
       {
-         rs1 = (instruction >> 15) & 0x1F;
-         rs2 = (instruction >> 20) & 0x1F;
-         if (registers[rs1] != registers[rs2])
+         for (const decoded_instruction *counted = first; counted != d; counted++)
          {
-            int32_t imm = ((instruction >> 31) & 0x1) << 12 | ((instruction >> 7) & 0x1) << 11 | ((instruction >> 25) & 0x3F) << 5 | ((instruction >> 8) & 0xF) << 1;
-            if (imm & 0x800)
-            {
-               imm |= 0xFFFFFFFFFFFFF000;
-            }
-            set_pc(pc + imm - 4);
+            op_counts[counted->op]++;
          }
       }
-      break;
-      case 0b000:
+      // Jumps end blocks, so the run executed is charged to the caller before any call
+      if (profiled && d != first)
       {
-         rs1 = (instruction >> 15) & 0x1F;
-         rs2 = (instruction >> 20) & 0x1F;
-         if (registers[rs1] == registers[rs2])
+         if (block->compressed)
          {
-            int32_t imm = ((instruction >> 31) & 0x1) << 12 | ((instruction >> 7) & 0x1) << 11 | ((instruction >> 25) & 0x3F) << 5 | ((instruction >> 8) & 0xF) << 1;
-            if (imm & 0x800)
+            uint64_t address = block_pc;
+            for (const decoded_instruction *retired = first; retired != d; retired++)
             {
-               imm |= 0xFFFFFFFFFFFFF000;
+               profile->retire(address, 1);
+               address += instruction_length(*retired);
             }
-            set_pc(pc + imm - 4);
          }
-      }
-      case 0b100:
-      {
-
-         rs1 = (instruction >> 15) & 0x1F;
-         rs2 = (instruction >> 20) & 0x1F;
-         if ((int64_t)registers[rs1] < (int64_t)registers[rs2])
+         else
          {
-            int32_t imm = ((instruction >> 31) & 0x1) << 12 | ((instruction >> 7) & 0x1) << 11 | ((instruction >> 25) & 0x3F) << 5 | ((instruction >> 8) & 0xF) << 1;
-            if (imm & 0x800)
-            {
-               imm |= 0xFFFFFFFFFFFFF000;
-            }
-            set_pc(pc + imm - 4);
+            profile->retire(block_pc, d - first);
          }
-      }
-      break;
-      case 0b101:
-      {
-         rs1 = (instruction >> 15) & 0x1F;
-         rs2 = (instruction >> 20) & 0x1F;
-         if ((int64_t)registers[rs1] >= (int64_t)registers[rs2])
+         if (d[-1].op == op_jal || d[-1].op == op_jalr)
          {
-            int32_t imm = ((instruction >> 31) & 0x1) << 12 | ((instruction >> 7) & 0x1) << 11 | ((instruction >> 25) & 0x3F) << 5 | ((instruction >> 8) & 0xF) << 1;
-            if (imm & 0x800)
-            {
-               imm |= 0xFFFFFFFFFFFFF000;
-            }
-            set_pc(pc + imm - 4);
+            profile_jump(d[-1]);
          }
       }
-      break;
-      case 0b110:
+      if (stop_requested)
       {
-         rs1 = (instruction >> 15) & 0x1F;
-         rs2 = (instruction >> 20) & 0x1F;
-         if (registers[rs1] < registers[rs2])
-         {
-            int32_t imm = ((instruction >> 31) & 0x1) << 12 | ((instruction >> 7) & 0x1) << 11 | ((instruction >> 25) & 0x3F) << 5 | ((instruction >> 8) & 0xF) << 1;
-            if (imm & 0x800)
-            {
-               imm |= 0xFFFFFFFFFFFFF000;
-            }
-            set_pc(pc + imm - 4);
-         }
+         return true;
       }
-      break;
-      case 0b111:
+
+      // Follow the chained successor, looking it up on first use. A successor is only valid
+      // for the code cache its block came from.
+      if (decode_generation & leave_block)
       {
-         rs1 = (instruction >> 15) & 0x1F;
-         rs2 = (instruction >> 20) & 0x1F;
-         if (registers[rs1] >= registers[rs2])
-         {
-            int32_t imm = ((instruction >> 31) & 0x1) << 12 | ((instruction >> 7) & 0x1) << 11 | ((instruction >> 25) & 0x3F) << 5 | ((instruction >> 8) & 0xF) << 1;
-            if (imm & 0x800)
-            {
-               imm |= 0xFFFFFFFFFFFFF000;
-            }
-            set_pc(pc + imm - 4);
-         }
-      }
-      break;
-      default:
-         exception_handling(2, instruction);
-         break;
+         decode_generation &= ~leave_block;
       }
-      break;
-   case 0b0111011:
-      switch (funct3)
+      if (Main_Memory->get_code_generation() != decode_generation || code != block_code)
       {
-      case 0b000:
-      {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rs2 = (instruction & 0x01F00000) >> 20;
-         rd = (instruction & 0x00000F80) >> 7;
-         funct7 = (instruction & 0xFE000000) >> 25;
-         switch (funct7)
-         {
-         case 0b0000000:
-            set_reg(rd, (int32_t)registers[rs1] + (int32_t)registers[rs2]);
-            break;
-         case 0b0100000:
-            set_reg(rd, (int32_t)registers[rs1] - (int32_t)registers[rs2]);
-            break;
-         default:
-            exception_handling(2, instruction);
-            break;
-         }
+         block = NULL;
       }
-      break;
-      case 0b001:
+      else if (pc == block->taken_pc)
       {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rs2 = (instruction & 0x01F00000) >> 20;
-         rd = (instruction & 0x00000F80) >> 7;
-         uint64_t result = registers[rs1] << (registers[rs2] & 0x1F);
-         result &= 0xFFFFFFFF;
-         if (result & 0x80000000)
+         if (block->taken == NULL)
          {
-            result |= 0xFFFFFFFF00000000;
+            block->taken = lookup_block(pc);
          }
-         set_reg(rd, result);
+         block = block->taken;
       }
-      break;
-      case 0b101:
+      else if (pc == block->end)
       {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rs2 = (instruction & 0x01F00000) >> 20;
-         rd = (instruction & 0x00000F80) >> 7;
-         funct7 = (instruction & 0xFE000000) >> 25;
-         uint64_t result;
-         switch (funct7)
+         if (block->fallthrough == NULL)
          {
-         case 0b0000000:
-            result = (registers[rs1] & 0x00000000ffffffff) >> (registers[rs2] & 0x1F);
-            result &= 0xFFFFFFFF;
-            if (result & 0x80000000)
-            {
-               result |= 0xFFFFFFFF00000000;
-            }
-            set_reg(rd, result);
-            break;
-         case 0b0100000:
-            set_reg(rd, (int32_t)registers[rs1] >> (registers[rs2] & 0x1F));
-            break;
-         default:
-            exception_handling(2, instruction);
-            break;
+            block->fallthrough = lookup_block(pc);
          }
+         block = block->fallthrough;
       }
-      break;
-      default:
-         exception_handling(2, instruction);
-         break;
-      }
-      break;
-   case 0b0011011:
-      switch (funct3)
+      else
       {
-      case 0b000:
+         block = NULL;
+      }
+   }
+   return false;
+}
+
+// Return the translated block starting at address, translating it on first use, or NULL if
+// its first instruction cannot be fetched. A block is a straight-line run of instructions
+// starting within one memory page, ending at the first control transfer, system or CSR
+// instruction, or before an instruction that cannot be fetched.
+processor::translated_block *processor::lookup_block(uint64_t address)
+{
+   if (Main_Memory->get_code_generation() != decode_generation)
+   {
+      flush_decode_cache();
+   }
+   unordered_map<uint64_t, translated_block>::iterator it = code->blocks.find(address);
+   if (it != code->blocks.end())
+   {
+      return &it->second;
+   }
+   const decoded_instruction *d = fetch_decoded(address);
+   if (d == NULL)
+   {
+      return NULL;
+   }
+
+   translated_block block;
+   block.start = address;
+   block.taken_pc = 1;
+   block.taken = NULL;
+   block.fallthrough = NULL;
+   block.runs = 0;
+   block.taken_runs = 0;
+   block.compressed = false;
+   uint64_t next = address;
+   while (true)
+   {
+      block.instructions.push_back(*d);
+      if (instruction_length(*d) != 4)
       {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rd = (instruction & 0x00000F80) >> 7;
-         imm = ((int64_t)(int32_t)instruction) >> 20;
-         int64_t result = (int64_t)((int32_t)registers[rs1] + (int32_t)imm);
-         set_reg(rd, result);
+         block.compressed = true;
       }
-      break;
-      case 0b001:
+      if (ends_block(d->op))
       {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         uint64_t shamt = (instruction & 0x01F00000) >> 20;
-         rd = (instruction & 0x00000F80) >> 7;
-         uint64_t result = registers[rs1] << shamt;
-         result &= 0xFFFFFFFF;
-         if (result & 0x80000000)
+         if (d->op == op_jal || (d->op >= op_beq && d->op <= op_bgeu))
          {
-            result |= 0xFFFFFFFF00000000;
+            block.taken_pc = next + d->imm;
          }
-         set_reg(rd, result);
+         next += instruction_length(*d);
+         break;
       }
-      break;
-      case 0b101:
+      next += instruction_length(*d);
+      if (((next ^ address) & ~2047) != 0)
       {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         uint64_t shamt = (instruction & 0x01F00000) >> 20;
-         rd = (instruction & 0x00000F80) >> 7;
-         uint64_t result;
-         funct7 = (instruction & 0xFE000000) >> 25;
-         switch (funct7)
-         {
-         case 0b0000000:
-            result = (registers[rs1] & 0x00000000ffffffff) >> shamt;
-            if (result & 0x80000000)
-            {
-               result |= 0xFFFFFFFF00000000;
-            }
-            set_reg(rd, result);
-            break;
-         case 0b0100000:
-            set_reg(rd, (int32_t)registers[rs1] >> shamt);
-            break;
-         default:
-            exception_handling(2, instruction);
-            break;
-         }
+         break;
       }
-      break;
-      default:
-         exception_handling(2, instruction);
+      d = fetch_decoded(next);
+      if (d == NULL)
+      {
          break;
       }
-      break;
-   case 0b1101111:
+   }
+   block.end = next;
+   return &code->blocks.insert(make_pair(address, block)).first->second;
+}
+
+bool processor::ends_block(uint8_t op)
+{
+   switch (op)
    {
-      uint64_t imm2 = (((instruction >> 12) & 0xFF) << 12);
-      uint64_t imm3 = (((instruction >> 20) & 0x1) << 11);
-      uint64_t imm4 = (((instruction >> 21) & 0x3FF) << 1);
-      imm = ((int64_t)(int32_t)instruction) >> 31;
-      imm = imm << 20;
-      imm = imm + imm2 + imm3 + imm4;
-      rd = (instruction & 0x00000F80) >> 7;
-      set_reg(rd, pc + 4);
-      set_pc(pc + (imm - 4));
+   case op_illegal:
+   case op_jal:
+   case op_jalr:
+   case op_beq:
+   case op_bne:
+   case op_blt:
+   case op_bge:
+   case op_bltu:
+   case op_bgeu:
+   case op_ecall:
+   case op_ebreak:
+   case op_mret:
+   case op_sret:
+   case op_sfence_vma:
+   case op_fence_i:
+   case op_csrrw:
+   case op_csrrs:
+   case op_csrrc:
+   case op_csrrwi:
+   case op_csrrsi:
+   case op_csrrci:
+      return true;
+   default:
+      return false;
    }
-   break;
-   case 0b0000011:
-      switch (funct3)
-      {
-      case 0b011:
+}
+
+// Return the decoded form of the instruction at address, decoding it on first use, or NULL
+// if it cannot be fetched, with the address that could not be translated in
+// fetch_fault_address. Decoded instructions are cached per page, one entry per halfword, and
+// a page is dropped from the cache once memory reports that code in it has been written. A
+// compressed instruction is expanded when it is decoded, so only its first execution pays
+// for that. Only a decode translates the address, so cached instructions cost nothing more
+// to fetch with translation.
+const processor::decoded_instruction *processor::fetch_decoded(uint64_t address)
+{
+   if (Main_Memory->get_code_generation() != decode_generation)
+   {
+      flush_decode_cache();
+   }
+   uint64_t page = address & ~2047;
+   if (page != code->last_page_address || code->last_page == NULL)
+   {
+      unordered_map<uint64_t, decoded_page>::iterator it = code->pages.find(page);
+      if (it == code->pages.end())
       {
-         rd = (instruction & 0x00000F80) >> 7;
-         rs1 = (instruction & 0x000F8000) >> 15;
-         imm = ((int64_t)(int32_t)instruction) >> 20;
-         int64_t targetAddress = registers[rs1] + imm;
-         if (targetAddress % 8 != 0)
+         decoded_page new_page;
+         new_page.physical = page;
+         if (fetch_translated)
          {
-            exception_handling(4, instruction);
-            break;
+            tlb_entry *entry = translate(address, access_fetch);
+            if (entry == NULL)
+            {
+               fetch_fault_address = address;
+               return NULL;
+            }
+            new_page.physical = entry->physical;
          }
-         uint64_t loadDoubleword = Main_Memory->read_doubleword(targetAddress);
-         set_reg(rd, loadDoubleword);
+         new_page.instructions.resize(1024);
+         it = code->pages.insert(make_pair(page, new_page)).first;
       }
-      break;
-      case 0b001:
+      code->last_page_address = page;
+      code->last_page = it->second.instructions.data();
+   }
+   decoded_instruction &entry = code->last_page[(address & 2047) >> 1];
+   if (entry.op == op_undecoded)
+   {
+      uint64_t physical = address;
+      uint64_t upper = address + 2;
+      if (fetch_translated)
       {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rd = (instruction & 0x00000F80) >> 7;
-         imm = ((int64_t)(int32_t)instruction) >> 20;
-         int64_t targetAddress = registers[rs1] + imm;
-         if (targetAddress % 2 != 0)
+         // The upper half of a 32-bit instruction may be in the next page
+         tlb_entry *translation = translate(address, access_fetch);
+         tlb_entry *upper_translation = ((address + 2) & 2047) != 0 ? translation : translate(address + 2, access_fetch);
+         if (translation == NULL)
          {
-            exception_handling(4, instruction);
-            break;
+            fetch_fault_address = address;
+            return NULL;
          }
-         uint64_t loadDoubleword = Main_Memory->read_doubleword(targetAddress & ~0x7);
-         int64_t offset = targetAddress - (targetAddress & ~0x7);
-         int16_t loadHalfword = (int16_t)((loadDoubleword >> (offset * 8)) & 0xFFFF);
-         set_reg(rd, loadHalfword);
-      }
-      break;
-      case 0b101:
-      {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rd = (instruction & 0x00000F80) >> 7;
-         imm = ((int64_t)(int32_t)instruction) >> 20;
-         int64_t targetAddress = registers[rs1] + imm;
-         if (targetAddress % 2 != 0)
+         physical = translation->physical | (address & 2047);
+         if (upper_translation != NULL)
          {
-            exception_handling(4, instruction);
-            break;
+            upper = upper_translation->physical | ((address + 2) & 2047);
          }
-         int64_t align = targetAddress & ~0x7;
-         uint64_t loadDoubleword = Main_Memory->read_doubleword(align);
-         int64_t offset = targetAddress - align;
-         uint16_t loadHalfword = (loadDoubleword >> (offset * 8)) & 0xFFFF;
-         set_reg(rd, loadHalfword);
-      }
-      break;
-      case 0b010:
-      {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rd = (instruction & 0x00000F80) >> 7;
-         imm = ((int64_t)(int32_t)instruction) >> 20;
-         int64_t targetAddress = registers[rs1] + imm;
-         if (targetAddress % 4 != 0)
+         else if ((Main_Memory->read16(physical) & 3) == 3)
          {
-            exception_handling(4, instruction);
-            break;
+            fetch_fault_address = address + 2;
+            return NULL;
          }
-         uint64_t loadDoubleword = Main_Memory->read_doubleword(targetAddress & ~0x7);
-         int64_t offset = targetAddress - (targetAddress & ~0x7);
-         int32_t loadWord = (int32_t)((loadDoubleword >> (offset * 8)) & 0xFFFFFFFF);
-         set_reg(rd, loadWord);
       }
-      break;
-      case 0b110:
+      uint32_t instruction = Main_Memory->read16(physical);
+      if ((instruction & 3) == 3)
       {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rd = (instruction & 0x00000F80) >> 7;
-         imm = ((int64_t)(int32_t)instruction) >> 20;
-         int64_t targetAddress = registers[rs1] + imm;
-         if (targetAddress % 4 != 0)
+         // The upper half may be in the next doubleword, or the next page
+         instruction |= (uint32_t)Main_Memory->read16(upper) << 16;
+         if (upper % 8 == 0)
          {
-            exception_handling(4, instruction);
-            break;
+            Main_Memory->mark_code(upper);
          }
-         int64_t align = targetAddress & ~0x7;
-         uint64_t loadDoubleword = Main_Memory->read_doubleword(align);
-         int64_t offset = targetAddress - align;
-         uint32_t loadWord = (uint32_t)((loadDoubleword >> (offset * 8)) & 0xFFFFFFFF);
-         set_reg(rd, loadWord);
-      }
-      break;
-      case 0b000:
-      {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rd = (instruction & 0x00000F80) >> 7;
-         imm = ((int64_t)(int32_t)instruction) >> 20;
-         int64_t targetAddress = registers[rs1] + imm;
-         int64_t align = targetAddress & ~0x7;
-         uint64_t loadDoubleword = Main_Memory->read_doubleword(align);
-         int64_t offset = targetAddress - align;
-         int8_t loadByte = (int8_t)((loadDoubleword >> (offset * 8)) & 0xFF);
-         set_reg(rd, loadByte);
       }
-      break;
-      case 0b100:
-      {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rd = (instruction & 0x00000F80) >> 7;
-         imm = ((int64_t)(int32_t)instruction) >> 20;
-         int64_t targetAddress = registers[rs1] + imm;
-         int64_t align = targetAddress & ~0x7;
-         uint64_t loadDoubleword = Main_Memory->read_doubleword(align);
-         int64_t offset = targetAddress - align;
-         uint8_t loadWord = (uint8_t)((loadDoubleword >> (offset * 8)) & 0xFF);
-         set_reg(rd, loadWord);
-      }
-      break;
-      default:
-         exception_handling(2, instruction);
-         break;
-      }
-      break;
-   case 0b0100011:
-      switch (funct3)
-      {
-      case 0b011:
+      entry = decode(instruction);
+      Main_Memory->mark_code(physical);
+   }
+   return &entry;
+}
+
+// Drop decoded pages and translated blocks whose code has been written since they were
+// decoded, and all translated code if the translations have changed. Block chains may point
+// at dropped blocks, so all chains are rebuilt on demand. An instruction in the last
+// halfword of a page, and a block ending with it, may continue into the next page, so those
+// are dropped from every page kept.
+void processor::flush_decode_cache()
+{
+   for (int i = 0; i < 3; i++)
+   {
+      code_cache &cache = code_caches[i];
+      if ((i > 0 && translated_code_stale) || all_code_stale)
       {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rs2 = (instruction & 0x01F00000) >> 20;
-         uint32_t imm2 = (instruction & 0x00000F80) >> 7;
-         imm = ((int64_t)(int32_t)instruction) >> 25;
-         imm = (imm << 5) + imm2;
-         uint64_t targetAddress = registers[rs1] + imm;
-         if (targetAddress % 8 != 0)
+         for (unordered_map<uint64_t, translated_block>::iterator it = cache.blocks.begin(); it != cache.blocks.end(); ++it)
          {
-            exception_handling(6, instruction);
-            break;
+            count_block(it->second);
          }
-         Main_Memory->write_doubleword(targetAddress, registers[rs2], 0xFFFFFFFFFFFFFFFF);
+         cache.blocks.clear();
+         cache.pages.clear();
       }
-      break;
-      case 0b000:
-      {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rs2 = (instruction & 0x01F00000) >> 20;
-         uint32_t imm2 = (instruction & 0x00000F80) >> 7;
-         imm = ((int64_t)(int32_t)instruction) >> 25;
-         imm = (imm << 5) + imm2;
-         uint64_t targetAddress = registers[rs1] + imm;
-         int64_t offset = targetAddress - (targetAddress & ~0x7);
-         Main_Memory->write_doubleword(targetAddress, registers[rs2] << (offset * 8), 0xFFULL << (offset * 8));
-      }
-      break;
-      case 0b001:
+      unordered_map<uint64_t, decoded_page>::iterator it = cache.pages.begin();
+      while (it != cache.pages.end())
       {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rs2 = (instruction & 0x01F00000) >> 20;
-         uint32_t imm2 = (instruction & 0x00000F80) >> 7;
-         imm = ((int64_t)(int32_t)instruction) >> 25;
-         imm = (imm << 5) + imm2;
-         uint64_t targetAddress = registers[rs1] + imm;
-         if (targetAddress % 2 != 0)
+         if (Main_Memory->is_code_page(it->second.physical))
          {
-            exception_handling(6, instruction);
-            break;
+            it->second.instructions.back() = decoded_instruction();
+            ++it;
          }
-         int64_t offset = targetAddress - (targetAddress & ~0x7);
-         Main_Memory->write_doubleword(targetAddress, registers[rs2] << (offset * 8), 0xFFFFULL << (offset * 8));
-      }
-      break;
-      case 0b010:
-      {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rs2 = (instruction & 0x01F00000) >> 20;
-         uint32_t imm2 = (instruction & 0x00000F80) >> 7;
-         imm = ((int64_t)(int32_t)instruction) >> 25;
-         imm = (imm << 5) + imm2;
-         uint64_t targetAddress = registers[rs1] + imm;
-         if (targetAddress % 4 != 0)
+         else
          {
-            exception_handling(6, instruction);
-            break;
+            it = cache.pages.erase(it);
          }
-         int64_t align = targetAddress & ~0x7;
-         int64_t offset = targetAddress - align;
-         Main_Memory->write_doubleword(targetAddress, registers[rs2] << (offset * 8), 0xFFFFFFFFULL << (offset * 8));
-      }
-      break;
-      default:
-         exception_handling(2, instruction);
-         break;
       }
-      break;
-   case 0b1110011:
-   {
-      switch (funct3)
-      {
-      case 0b000:
+      unordered_map<uint64_t, translated_block>::iterator block_it = cache.blocks.begin();
+      while (block_it != cache.blocks.end())
       {
-         uint32_t funct12 = (instruction & 0xFFF00000) >> 20;
-         switch (funct12)
-         {
-         case 0b000000000000:
-         {
-            if (prv == 0)
-            {
-               exception_handling(8, instruction);
-               break;
-            }
-            if (prv == 3)
-            {
-               exception_handling(11, instruction);
-               break;
-            }
-         }
-         break;
-         case 0b000000000001:
+         uint64_t page = block_it->first & ~2047;
+         if (cache.pages.find(page) != cache.pages.end() && ((block_it->second.end - 1) & ~2047) == page)
          {
-            set_csr(0x341, pc);
-            set_csr(0x342, 3);
-            uint64_t base = csr_register[0x305] & 0xfffffffffffffffc;
-            uint64_t inter = (csr_register[0x342] & 0x8000000000000000) >> 63;
-            set_pc(base + (4 * inter) - 4);
-            uint64_t mstatus = csr_register[0x300];
-            uint64_t mie = (mstatus >> 3) & 1;
-            mstatus &= 0xffffffffffffe777;
-            mstatus |= (prv << 11) | (mie << 7);
-            set_csr(0x300, mstatus);
-            prv = 3;
-            instruction_count--;
+            block_it->second.taken = NULL;
+            block_it->second.fallthrough = NULL;
+            ++block_it;
          }
-         break;
-         case 0b001100000010:
+         else
          {
-            if (prv == 0)
-            {
-               exception_handling(2, instruction);
-               break;
-            }
-            else
-            {
-               set_pc(csr_register[0x341] - 4);
-               uint64_t mstatus = csr_register[0x300];
-               prv = (mstatus >> 11) & 0x3;
-               uint64_t temp = (mstatus & 0x80) >> 4;
-               set_csr(0x300, (mstatus & 0xffffffffffffe777) | (temp | 0x0000000000000080));
-            }
-         }
-         break;
-         default:
-            exception_handling(2, instruction);
-            break;
+            count_block(block_it->second);
+            block_it = cache.blocks.erase(block_it);
          }
       }
-      break;
-      case 0b001:
+      cache.last_page = NULL;
+   }
+   translated_code_stale = false;
+   all_code_stale = false;
+   decode_generation = Main_Memory->get_code_generation();
+}
+
+// Recompute whether fetches and data accesses are translated, and at which privilege. Must be
+// called whenever prv, mstatus or satp changes.
+void processor::update_translation()
+{
+   uint64_t mstatus = csr_register[csr_mstatus];
+   bool sv39 = (csr_register[csr_satp] >> 60) == 8;
+   data_privilege = (prv == 3 && (mstatus & mstatus_mprv)) ? (mstatus & mstatus_mpp) >> 11 : prv;
+   fetch_translated = sv39 && prv != 3;
+   data_translated = sv39 && data_privilege != 3;
+   // The page number takes the low 53 bits of a tag, so the context goes above it. Untranslated
+   // accesses also use the TLBs, for the host page, with a context of their own.
+   fetch_context = fetch_translated ? (uint64_t)(prv == 0) << 56 : 1ULL << 59;
+   data_context = data_translated ? ((uint64_t)(data_privilege == 0) << 56) | ((mstatus & (mstatus_sum | mstatus_mxr)) << 39)
+                                  : 1ULL << 59;
+   code = &code_caches[fetch_translated ? (prv == 0 ? 2 : 1) : 0];
+}
+
+// Drop every cached translation, and the code decoded through them. The code caches are
+// flushed when execution next reaches a block or instruction boundary, as a write to code is.
+void processor::flush_translations()
+{
+   for (int type = 0; type < 3; type++)
+   {
+      for (unsigned int i = 0; i < tlb_size; i++)
       {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rd = (instruction & 0x00000F80) >> 7;
-         uint64_t csr = (instruction >> 20) & 0xFFF;
-         if (prv == 0 || !csr_check(csr) || (csr == 0xF11 && rs1 != 0) || (csr == 0xF12 && rs1 != 0) || (csr == 0xF13 && rs1 != 0) || (csr == 0xF14 && rs1 != 0))
-         {
-            exception_handling(2, instruction);
-            break;
-         }
-         set_reg(rd, csr_register[csr]);
-         uint64_t temp = registers[rs1];
-         if (csr == 0x344)
-         {
-            temp &= 0x111;
-         }
-         set_csr(csr, temp);
+         tlbs[type][i].tag = ~(uint64_t)0;
       }
-      break;
-      case 0b010:
+   }
+   translated_code_stale = true;
+   decode_generation = ~(uint64_t)0;
+}
+
+// Return the TLB entry translating an address for an access, or NULL if the access
+// causes a page fault
+inline processor::tlb_entry *processor::translate(uint64_t address, access_type type)
+{
+   tlb_entry &entry = tlbs[type][(address >> 11) % tlb_size];
+   if (entry.tag == ((address >> 11) | (type == access_fetch ? fetch_context : data_context)))
+   {
+      return &entry;
+   }
+   return fill_tlb(address, type);
+}
+
+// Translate an address that missed in the TLB and enter the translation. Return NULL if the
+// access causes a page fault, or device_entry, with no host page, for an address a device claims.
+processor::tlb_entry *processor::fill_tlb(uint64_t address, access_type type)
+{
+   uint64_t physical = address;
+   bool translated = type == access_fetch ? fetch_translated : data_translated;
+   if (translated && !walk_page_table(address, type, physical))
+   {
+      return NULL;
+   }
+   uint8_t *host = Main_Memory->host_page(physical);
+   if (host == NULL)
+   {
+      device_entry.physical = physical & ~2047;
+      return &device_entry;
+   }
+   tlb_entry &entry = tlbs[type][(address >> 11) % tlb_size];
+   entry.tag = (address >> 11) | (type == access_fetch ? fetch_context : data_context);
+   entry.physical = physical & ~2047;
+   entry.host = host;
+   return &entry;
+}
+
+// Translate a virtual address through the Sv39 page table, checking the permissions of the
+// leaf entry and setting its accessed bit, and its dirty bit for a store. Return false if the
+// access causes a page fault.
+bool processor::walk_page_table(uint64_t address, access_type type, uint64_t &physical)
+{
+   // Bits 63-39 must all equal bit 38
+   if ((uint64_t)((int64_t)address << 25 >> 25) != address)
+   {
+      return false;
+   }
+   uint64_t mstatus = csr_register[csr_mstatus];
+   uint64_t privilege = type == access_fetch ? prv : data_privilege;
+   uint64_t table = (csr_register[csr_satp] & 0xfffffffffff) << 12;
+   for (int level = 2; level >= 0; level--)
+   {
+      uint64_t entry_address = table + ((address >> (12 + 9 * level)) & 511) * 8;
+      uint64_t pte = Main_Memory->read64(entry_address);
+      if (!(pte & pte_v) || (!(pte & pte_r) && (pte & pte_w)) || (pte >> 54) != 0)
       {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rd = (instruction & 0x00000F80) >> 7;
-         uint64_t csr = (instruction >> 20) & 0xFFF;
-         if (prv == 0 || !csr_check(csr) || (csr == 0xF11 && rs1 != 0) || (csr == 0xF12 && rs1 != 0) || (csr == 0xF13 && rs1 != 0) || (csr == 0xF14 && rs1 != 0))
-         {
-            exception_handling(2, instruction);
-            break;
-         }
-         set_reg(rd, csr_register[csr]);
-         uint64_t temp = registers[rs1] | csr_register[csr];
-         if (csr != 0xF11 && csr != 0xF12 && csr != 0xF13 && csr != 0xF14)
-         {
-            if (csr == 0x344)
-            {
-               temp &= 0x111;
-            }
-            set_csr(csr, temp);
-         }
+         return false;
       }
-      break;
-      case 0b011:
+      uint64_t ppn = (pte >> 10) & 0xfffffffffff;
+      if (!(pte & (pte_r | pte_x)))
       {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rd = (instruction & 0x00000F80) >> 7;
-         uint64_t csr = (instruction >> 20) & 0xFFF;
-         if (prv == 0 || !csr_check(csr) || (csr == 0xF11 && rs1 != 0) || (csr == 0xF12 && rs1 != 0) || (csr == 0xF13 && rs1 != 0) || (csr == 0xF14 && rs1 != 0))
-         {
-            exception_handling(2, instruction);
-            break;
-         }
-         set_reg(rd, csr_register[csr]);
-         uint64_t temp = (~registers[rs1]) & csr_register[csr];
-         if (csr != 0xF11 && csr != 0xF12 && csr != 0xF13 && csr != 0xF14)
-         {
-            if (csr == 0x344)
-            {
-               temp &= 0x111;
-            }
-            set_csr(csr, temp);
-         }
+         table = ppn << 12;
+         continue;
       }
-      break;
-      case 0b101:
+      // A leaf. Supervisor mode can reach user pages only for loads and stores with SUM set.
+      bool permitted = privilege == 0 ? (pte & pte_u) != 0
+                                      : !(pte & pte_u) || (type != access_fetch && (mstatus & mstatus_sum));
+      switch (type)
       {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rd = (instruction & 0x00000F80) >> 7;
-         uint64_t csr = (instruction >> 20) & 0xFFF;
-         if (prv == 0 || !csr_check(csr) || (csr == 0xF11 && rs1 != 0) || (csr == 0xF12 && rs1 != 0) || (csr == 0xF13 && rs1 != 0) || (csr == 0xF14 && rs1 != 0))
-         {
-            exception_handling(2, instruction);
-            break;
-         }
-         set_reg(rd, csr_register[csr]);
-         if (csr == 0x344)
-         {
-            rs1 &= 0x111;
-         }
-         set_csr(csr, rs1);
+      case access_fetch:
+         permitted = permitted && (pte & pte_x);
+         break;
+      case access_load:
+         permitted = permitted && ((pte & pte_r) || ((mstatus & mstatus_mxr) && (pte & pte_x)));
+         break;
+      default:
+         permitted = permitted && (pte & pte_w);
+         break;
       }
-      break;
-      case 0b110:
+      uint64_t offset_mask = (1ULL << (12 + 9 * level)) - 1;
+      if (!permitted || ((ppn << 12) & offset_mask) != 0)
       {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rd = (instruction & 0x00000F80) >> 7;
-         uint64_t csr = (instruction >> 20) & 0xFFF;
-         if (prv == 0 || !csr_check(csr) || (csr == 0xF11 && rs1 != 0) || (csr == 0xF12 && rs1 != 0) || (csr == 0xF13 && rs1 != 0) || (csr == 0xF14 && rs1 != 0))
-         {
-            exception_handling(2, instruction);
-            break;
-         }
-         uint64_t temp = csr_register[csr] | rs1;
-         set_reg(rd, csr_register[csr]);
-         if (csr != 0xF11 && csr != 0xF12 && csr != 0xF13 && csr != 0xF14)
-         {
-            if (csr == 0x344)
-            {
-               temp &= 0x111;
-            }
-            set_csr(csr, temp);
-         }
+         return false;
       }
-      break;
-      case 0b111:
+      uint64_t update = pte_a | (type == access_store ? pte_d : 0);
+      if ((pte & update) != update)
       {
-         rs1 = (instruction & 0x000F8000) >> 15;
-         rd = (instruction & 0x00000F80) >> 7;
-         uint64_t csr = (instruction >> 20) & 0xFFF;
-         if (prv == 0 || !csr_check(csr) || (csr == 0xF11 && rs1 != 0) || (csr == 0xF12 && rs1 != 0) || (csr == 0xF13 && rs1 != 0) || (csr == 0xF14 && rs1 != 0))
-         {
-            exception_handling(2, instruction);
-            break;
-         }
-         uint64_t temp = csr_register[csr] & ~rs1;
-         set_reg(rd, csr_register[csr]);
-         if (csr != 0xF11 && csr != 0xF12 && csr != 0xF13 && csr != 0xF14)
-         {
-            if (csr == 0x344)
-            {
-               temp &= 0x111;
-            }
-            set_csr(csr, temp);
-         }
-      }
-      break;
-      default:
-         exception_handling(2, instruction);
-         break;
+         Main_Memory->atomic_update(entry_address, memory::amo_or, update, false);
       }
-      break;
-   }
-   break;
-   default:
-      exception_handling(2, instruction);
-      break;
+      physical = (ppn << 12) | (address & offset_mask);
+      return true;
    }
+   return false;
 }
 
-uint64_t processor::get_instruction_count()
+// Load from a naturally aligned virtual address. Return false, having taken a page fault,
+// if the access is not permitted. Devices are never entered in the TLB, so a hit is always
+// to memory.
+template <typename T>
+inline bool processor::load(uint64_t address, T &value, unsigned int length)
 {
-   return instruction_count;
+   tlb_entry &entry = tlbs[access_load][(address >> 11) % tlb_size];
+   if (entry.tag == ((address >> 11) | data_context))
+   {
+      memcpy(&value, entry.host + (address & 2047), sizeof(T));
+      return true;
+   }
+   uint64_t data;
+   if (!access_uncached(address, access_load, data, sizeof(T), length))
+   {
+      return false;
+   }
+   value = data;
+   return true;
+}
+
+// Physical stores by width
+static inline void write_physical(memory *m, uint64_t address, uint8_t value) { m->write8(address, value); }
+static inline void write_physical(memory *m, uint64_t address, uint16_t value) { m->write16(address, value); }
+static inline void write_physical(memory *m, uint64_t address, uint32_t value) { m->write32(address, value); }
+static inline void write_physical(memory *m, uint64_t address, uint64_t value) { m->write64(address, value); }
+
+// Store to a naturally aligned virtual address. Return false, having taken a page fault, if
+// the access is not permitted. The store is made through memory, so that it keeps snapshots,
+// decoded code and reservations consistent.
+template <typename T>
+inline bool processor::store(uint64_t address, T value, unsigned int length)
+{
+   tlb_entry &entry = tlbs[access_store][(address >> 11) % tlb_size];
+   if (entry.tag == ((address >> 11) | data_context))
+   {
+      write_physical(Main_Memory, entry.physical | (address & 2047), value);
+      return true;
+   }
+   uint64_t data = value;
+   return access_uncached(address, access_store, data, sizeof(T), length);
+}
+
+// Make a load or store of bytes that missed in the TLB, translating it and passing it to a
+// device or to memory. Return false, having taken a page fault, if the access is not permitted.
+bool processor::access_uncached(uint64_t address, access_type type, uint64_t &data, unsigned int bytes,
+                                unsigned int length)
+{
+   tlb_entry *entry = fill_tlb(address, type);
+   if (entry == NULL)
+   {
+      exception_handling(type == access_load ? 13 : 15, address, length);
+      return false;
+   }
+   uint64_t physical = entry->physical | (address & 2047);
+   if (entry->host == NULL)
+   {
+      if (type == access_load)
+      {
+         data = Main_Memory->device_read(physical, bytes, instruction_count);
+      }
+      else
+      {
+         Main_Memory->device_write(physical, bytes, data, instruction_count);
+         // Leave the block, in case the write changed this hart's interrupts or halted it
+         if (block_mode)
+         {
+            decode_generation |= leave_block;
+         }
+         if (Main_Memory->is_halted())
+         {
+            stop_requested = true;
+         }
+      }
+      return true;
+   }
+   if (type == access_load)
+   {
+      data = 0;
+      memcpy(&data, entry->host + (address & 2047), bytes);
+      return true;
+   }
+   switch (bytes)
+   {
+   case 1:
+      Main_Memory->write8(physical, data);
+      break;
+   case 2:
+      Main_Memory->write16(physical, data);
+      break;
+   case 4:
+      Main_Memory->write32(physical, data);
+      break;
+   default:
+      Main_Memory->write64(physical, data);
+      break;
+   }
+   return true;
+}
+
+// Translate the address of an LR (if loading), SC or AMO in place. Return false, having taken
+// a page fault, if the access is not permitted, or an access fault if a device claims it.
+bool processor::translate_atomic(uint64_t &address, bool loading, unsigned int length)
+{
+   tlb_entry *entry = translate(address, loading ? access_load : access_store);
+   if (entry == NULL)
+   {
+      exception_handling(loading ? 13 : 15, address, length);
+      return false;
+   }
+   if (entry->host == NULL)
+   {
+      exception_handling(loading ? 5 : 7, address, length);
+      return false;
+   }
+   address = entry->physical | (address & 2047);
+   return true;
+}
+
+// Add the complete runs of a block to the instruction mix
+void processor::count_block(translated_block &block)
+{
+   if (block.runs == 0)
+   {
+      return;
+   }
+   for (unsigned int i = 0; i < block.instructions.size(); i++)
+   {
+      op_counts[block.instructions[i].op] += block.runs;
+   }
+   uint8_t last = block.instructions.back().op;
+   if (last >= op_beq && last <= op_bgeu)
+   {
+      branches_taken += block.taken_runs;
+   }
+   block.runs = 0;
+   block.taken_runs = 0;
+}
+
+// Decode an instruction into its handler id, register indices and sign-extended immediate.
+// Encodings that are not implemented decode to op_illegal.
+processor::decoded_instruction processor::decode(uint32_t instruction)
+{
+   decoded_instruction d;
+   if ((instruction & 3) != 3)
+   {
+      // Compressed: decode the 32-bit equivalent, keeping the 16-bit encoding
+      uint32_t expanded = expand_compressed(instruction);
+      if (expanded != 0)
+      {
+         d = decode(expanded);
+      }
+      else
+      {
+         d.op = op_illegal;
+         d.handler = handler_table[op_illegal];
+      }
+      d.raw = instruction & 0xFFFF;
+      return d;
+   }
+   uint32_t opcode = instruction & 0x0000007F;
+   uint32_t funct3 = (instruction & 0x00007000) >> 12;
+   uint32_t funct7 = (instruction & 0xFE000000) >> 25;
+
+   d.op = op_illegal;
+   d.rd = (instruction & 0x00000F80) >> 7;
+   d.rs1 = (instruction & 0x000F8000) >> 15;
+   d.rs2 = (instruction & 0x01F00000) >> 20;
+   d.raw = instruction;
+   d.imm = ((int64_t)(int32_t)instruction) >> 20;
+
+   switch (opcode)
+   {
+   case 0x0f:
+      // FENCE, including FENCE.TSO and PAUSE
+      if (funct3 == 0x0)
+      {
+         d.op = op_fence;
+      }
+      else if (funct3 == 0x1)
+      {
+         d.op = op_fence_i;
+      }
+      break;
+   case 0x37:
+      d.op = op_lui;
+      d.imm = (int64_t)(int32_t)(instruction & 0xFFFFF000);
+      break;
+   case 0x17:
+      d.op = op_auipc;
+      d.imm = (int64_t)(int32_t)(instruction & 0xFFFFF000);
+      break;
+   case 0x6f:
+      d.op = op_jal;
+      d.imm = ((((int64_t)(int32_t)instruction) >> 31) << 20) | (((instruction >> 12) & 0xFF) << 12) |
+              (((instruction >> 20) & 0x1) << 11) | (((instruction >> 21) & 0x3FF) << 1);
+      break;
+   case 0x67:
+      if (funct3 == 0x0)
+      {
+         d.op = op_jalr;
+      }
+      break;
+   case 0x63:
+   {
+      static const uint8_t branch_ops[8] = {op_beq, op_bne, op_illegal, op_illegal, op_blt, op_bge, op_bltu, op_bgeu};
+      d.op = branch_ops[funct3];
+      d.imm = ((((int64_t)(int32_t)instruction) >> 31) << 12) | (((instruction >> 7) & 0x1) << 11) |
+              (((instruction >> 25) & 0x3F) << 5) | (((instruction >> 8) & 0xF) << 1);
+   }
+   break;
+   case 0x03:
+   {
+      static const uint8_t load_ops[8] = {op_lb, op_lh, op_lw, op_ld, op_lbu, op_lhu, op_lwu, op_illegal};
+      d.op = load_ops[funct3];
+   }
+   break;
+   case 0x23:
+   {
+      static const uint8_t store_ops[8] = {op_sb, op_sh, op_sw, op_sd, op_illegal, op_illegal, op_illegal, op_illegal};
+      d.op = store_ops[funct3];
+      d.imm = ((((int64_t)(int32_t)instruction) >> 25) << 5) | ((instruction & 0x00000F80) >> 7);
+   }
+   break;
+   case 0x2f:
+      // Atomics, with the ordering bits (aq and rl) ignored as every access is sequentially consistent
+      d.imm = 0;
+      if (funct3 == 0x2 || funct3 == 0x3)
+      {
+         static const uint8_t word_ops[32] = {
+             op_amoadd_w, op_amoswap_w, op_lr_w, op_sc_w, op_amoxor_w, op_illegal, op_illegal, op_illegal,
+             op_amoor_w, op_illegal, op_illegal, op_illegal, op_amoand_w, op_illegal, op_illegal, op_illegal,
+             op_amomin_w, op_illegal, op_illegal, op_illegal, op_amomax_w, op_illegal, op_illegal, op_illegal,
+             op_amominu_w, op_illegal, op_illegal, op_illegal, op_amomaxu_w, op_illegal, op_illegal, op_illegal};
+         d.op = word_ops[funct7 >> 2];
+         if (d.op == op_lr_w && d.rs2 != 0)
+         {
+            d.op = op_illegal;
+         }
+         // The doubleword forms follow the word forms in the same order
+         if (funct3 == 0x3 && d.op != op_illegal)
+         {
+            d.op = d.op == op_lr_w ? op_lr_d : d.op == op_sc_w ? op_sc_d : d.op + (op_amoswap_d - op_amoswap_w);
+         }
+      }
+      break;
+   case 0x13:
+      switch (funct3)
+      {
+      case 0x0:
+         d.op = op_addi;
+         break;
+      case 0x2:
+         d.op = op_slti;
+         break;
+      case 0x3:
+         d.op = op_sltiu;
+         break;
+      case 0x4:
+         d.op = op_xori;
+         break;
+      case 0x6:
+         d.op = op_ori;
+         break;
+      case 0x7:
+         d.op = op_andi;
+         break;
+      case 0x1:
+         d.op = op_slli;
+         d.imm = (instruction >> 20) & 0x3F;
+         break;
+      case 0x5:
+         d.imm = (instruction >> 20) & 0x3F;
+         if ((funct7 & ~1) == 0x00)
+         {
+            d.op = op_srli;
+         }
+         else if ((funct7 & ~1) == 0x20)
+         {
+            d.op = op_srai;
+         }
+         break;
+      }
+      break;
+   case 0x1b:
+      d.imm = (funct3 == 0x0) ? d.imm : (instruction & 0x01F00000) >> 20;
+      switch (funct3)
+      {
+      case 0x0:
+         d.op = op_addiw;
+         break;
+      case 0x1:
+         d.op = op_slliw;
+         break;
+      case 0x5:
+         if (funct7 == 0x00)
+         {
+            d.op = op_srliw;
+         }
+         else if (funct7 == 0x20)
+         {
+            d.op = op_sraiw;
+         }
+         break;
+      }
+      break;
+   case 0x33:
+   {
+      // Operations by funct3 for funct7 0000000, 0100000 and 0000001 (the M extension)
+      static const uint8_t base_ops[8] = {op_add, op_sll, op_slt, op_sltu, op_xor, op_srl, op_or, op_and};
+      static const uint8_t alternate_ops[8] = {op_sub, op_illegal, op_illegal, op_illegal,
+                                               op_illegal, op_sra, op_illegal, op_illegal};
+      static const uint8_t multiply_ops[8] = {op_mul, op_mulh, op_mulhsu, op_mulhu, op_div, op_divu, op_rem, op_remu};
+      if (funct7 == 0x00)
+      {
+         d.op = base_ops[funct3];
+      }
+      else if (funct7 == 0x20)
+      {
+         d.op = alternate_ops[funct3];
+      }
+      else if (funct7 == 0x01)
+      {
+         d.op = multiply_ops[funct3];
+      }
+   }
+   break;
+   case 0x3b:
+   {
+      static const uint8_t base_ops[8] = {op_addw, op_sllw, op_illegal, op_illegal,
+                                          op_illegal, op_srlw, op_illegal, op_illegal};
+      static const uint8_t alternate_ops[8] = {op_subw, op_illegal, op_illegal, op_illegal,
+                                               op_illegal, op_sraw, op_illegal, op_illegal};
+      static const uint8_t multiply_ops[8] = {op_mulw, op_illegal, op_illegal, op_illegal,
+                                              op_divw, op_divuw, op_remw, op_remuw};
+      if (funct7 == 0x00)
+      {
+         d.op = base_ops[funct3];
+      }
+      else if (funct7 == 0x20)
+      {
+         d.op = alternate_ops[funct3];
+      }
+      else if (funct7 == 0x01)
+      {
+         d.op = multiply_ops[funct3];
+      }
+   }
+   break;
+   case 0x73:
+      d.imm = (instruction >> 20) & 0xFFF;
+      switch (funct3)
+      {
+      case 0x0:
+         switch (d.imm)
+         {
+         case 0x000:
+            d.op = op_ecall;
+            break;
+         case 0x001:
+            d.op = op_ebreak;
+            break;
+         case 0x302:
+            d.op = op_mret;
+            break;
+         case 0x102:
+            d.op = op_sret;
+            break;
+         case 0x105:
+            d.op = op_wfi;
+            break;
+         default:
+            if ((d.imm >> 5) == 0x09 && d.rd == 0)
+            {
+               d.op = op_sfence_vma;
+            }
+            break;
+         }
+         break;
+      case 0x1:
+         d.op = op_csrrw;
+         break;
+      case 0x2:
+         d.op = op_csrrs;
+         break;
+      case 0x3:
+         d.op = op_csrrc;
+         break;
+      case 0x5:
+         d.op = op_csrrwi;
+         break;
+      case 0x6:
+         d.op = op_csrrsi;
+         break;
+      case 0x7:
+         d.op = op_csrrci;
+         break;
+      }
+      break;
+   }
+   d.handler = handler_table[d.op];
+   return d;
+}
+
+void processor::execute_instruction(uint32_t instruction)
+{
+   decoded_instruction d = decode(instruction);
+   d.handler(*this, d);
+}
+
+// Execute a decoded instruction with handler id op. Control transfers set the PC to the
+// target minus the instruction length, since execute advances the PC past every instruction.
+// Each handler in handler_table instantiates this with a constant op, so the compiler
+// can reduce it to the code for that one instruction.
+inline void processor::execute_op(uint8_t op, const decoded_instruction &d)
+{
+   uint64_t rs1 = registers[d.rs1];
+   uint64_t rs2 = registers[d.rs2];
+   unsigned int length = instruction_length(d);
+
+   switch (op)
+   {
+   case op_lui:
+      set_reg(d.rd, d.imm);
+      break;
+   case op_auipc:
+      set_reg(d.rd, pc + d.imm);
+      break;
+   case op_jal:
+      set_reg(d.rd, pc + length);
+      set_pc(pc + d.imm - length);
+      break;
+   case op_jalr:
+   {
+      uint64_t targetAddress = (rs1 + d.imm) & ~1;
+      set_reg(d.rd, pc + length);
+      set_pc(targetAddress - length);
+   }
+   break;
+   case op_beq:
+      if (rs1 == rs2)
+      {
+         set_pc(pc + d.imm - length);
+      }
+      break;
+   case op_bne:
+      if (rs1 != rs2)
+      {
+         set_pc(pc + d.imm - length);
+      }
+      break;
+   case op_blt:
+      if ((int64_t)rs1 < (int64_t)rs2)
+      {
+         set_pc(pc + d.imm - length);
+      }
+      break;
+   case op_bge:
+      if ((int64_t)rs1 >= (int64_t)rs2)
+      {
+         set_pc(pc + d.imm - length);
+      }
+      break;
+   case op_bltu:
+      if (rs1 < rs2)
+      {
+         set_pc(pc + d.imm - length);
+      }
+      break;
+   case op_bgeu:
+      if (rs1 >= rs2)
+      {
+         set_pc(pc + d.imm - length);
+      }
+      break;
+   case op_lb:
+   case op_lbu:
+   {
+      uint8_t loadByte;
+      if (load(rs1 + d.imm, loadByte, length))
+      {
+         set_reg(d.rd, op == op_lb ? (int64_t)(int8_t)loadByte : loadByte);
+      }
+   }
+   break;
+   case op_lh:
+   case op_lhu:
+   {
+      uint64_t targetAddress = rs1 + d.imm;
+      if (targetAddress % 2 != 0)
+      {
+         exception_handling(4, targetAddress, length);
+         break;
+      }
+      uint16_t loadHalfword;
+      if (load(targetAddress, loadHalfword, length))
+      {
+         set_reg(d.rd, op == op_lh ? (int16_t)loadHalfword : loadHalfword);
+      }
+   }
+   break;
+   case op_lw:
+   case op_lwu:
+   {
+      uint64_t targetAddress = rs1 + d.imm;
+      if (targetAddress % 4 != 0)
+      {
+         exception_handling(4, targetAddress, length);
+         break;
+      }
+      uint32_t loadWord;
+      if (load(targetAddress, loadWord, length))
+      {
+         set_reg(d.rd, op == op_lw ? (int64_t)(int32_t)loadWord : (int64_t)loadWord);
+      }
+   }
+   break;
+   case op_ld:
+   {
+      uint64_t targetAddress = rs1 + d.imm;
+      if (targetAddress % 8 != 0)
+      {
+         exception_handling(4, targetAddress, length);
+         break;
+      }
+      uint64_t loadDoubleword;
+      if (load(targetAddress, loadDoubleword, length))
+      {
+         set_reg(d.rd, loadDoubleword);
+      }
+   }
+   break;
+   case op_sb:
+      store(rs1 + d.imm, (uint8_t)rs2, length);
+      break;
+   case op_sh:
+   {
+      uint64_t targetAddress = rs1 + d.imm;
+      if (targetAddress % 2 != 0)
+      {
+         exception_handling(6, targetAddress, length);
+         break;
+      }
+      store(targetAddress, (uint16_t)rs2, length);
+   }
+   break;
+   case op_sw:
+   {
+      uint64_t targetAddress = rs1 + d.imm;
+      if (targetAddress % 4 != 0)
+      {
+         exception_handling(6, targetAddress, length);
+         break;
+      }
+      store(targetAddress, (uint32_t)rs2, length);
+   }
+   break;
+   case op_sd:
+   {
+      uint64_t targetAddress = rs1 + d.imm;
+      if (targetAddress % 8 != 0)
+      {
+         exception_handling(6, targetAddress, length);
+         break;
+      }
+      store(targetAddress, rs2, length);
+   }
+   break;
+   case op_lr_w:
+   case op_lr_d:
+   {
+      bool word = op == op_lr_w;
+      if (rs1 % (word ? 4 : 8) != 0)
+      {
+         exception_handling(4, rs1, length);
+         break;
+      }
+      uint64_t physical = rs1;
+      if (!translate_atomic(physical, true, length))
+      {
+         break;
+      }
+      uint64_t loaded = Main_Memory->load_reserved(physical, word);
+      set_reg(d.rd, word ? (int64_t)(int32_t)loaded : loaded);
+   }
+   break;
+   case op_sc_w:
+   case op_sc_d:
+   {
+      bool word = op == op_sc_w;
+      if (rs1 % (word ? 4 : 8) != 0)
+      {
+         exception_handling(6, rs1, length);
+         break;
+      }
+      uint64_t physical = rs1;
+      if (!translate_atomic(physical, false, length))
+      {
+         break;
+      }
+      set_reg(d.rd, Main_Memory->store_conditional(physical, rs2, word) ? 0 : 1);
+   }
+   break;
+   case op_amoswap_w:
+   case op_amoadd_w:
+   case op_amoxor_w:
+   case op_amoand_w:
+   case op_amoor_w:
+   case op_amomin_w:
+   case op_amomax_w:
+   case op_amominu_w:
+   case op_amomaxu_w:
+   case op_amoswap_d:
+   case op_amoadd_d:
+   case op_amoxor_d:
+   case op_amoand_d:
+   case op_amoor_d:
+   case op_amomin_d:
+   case op_amomax_d:
+   case op_amominu_d:
+   case op_amomaxu_d:
+   {
+      bool word = op <= op_amomaxu_w;
+      if (rs1 % (word ? 4 : 8) != 0)
+      {
+         exception_handling(6, rs1, length);
+         break;
+      }
+      uint64_t physical = rs1;
+      if (!translate_atomic(physical, false, length))
+      {
+         break;
+      }
+      // The AMOs are in the order of atomic_op for each width
+      memory::atomic_op amo = (memory::atomic_op)(op - (word ? op_amoswap_w : op_amoswap_d));
+      uint64_t old = Main_Memory->atomic_update(physical, amo, rs2, word);
+      set_reg(d.rd, word ? (int64_t)(int32_t)old : old);
+   }
+   break;
+   case op_addi:
+      set_reg(d.rd, rs1 + d.imm);
+      break;
+   case op_slti:
+      set_reg(d.rd, (int64_t)rs1 < d.imm ? 1 : 0);
+      break;
+   case op_sltiu:
+      set_reg(d.rd, rs1 < (uint64_t)d.imm ? 1 : 0);
+      break;
+   case op_xori:
+      set_reg(d.rd, rs1 ^ d.imm);
+      break;
+   case op_ori:
+      set_reg(d.rd, rs1 | d.imm);
+      break;
+   case op_andi:
+      set_reg(d.rd, rs1 & d.imm);
+      break;
+   case op_slli:
+      set_reg(d.rd, rs1 << d.imm);
+      break;
+   case op_srli:
+      set_reg(d.rd, rs1 >> d.imm);
+      break;
+   case op_srai:
+      set_reg(d.rd, (int64_t)rs1 >> d.imm);
+      break;
+   case op_add:
+      set_reg(d.rd, rs1 + rs2);
+      break;
+   case op_sub:
+      set_reg(d.rd, rs1 - rs2);
+      break;
+   case op_sll:
+      set_reg(d.rd, rs1 << (rs2 & 0x3F));
+      break;
+   case op_slt:
+      set_reg(d.rd, (int64_t)rs1 < (int64_t)rs2 ? 1 : 0);
+      break;
+   case op_sltu:
+      set_reg(d.rd, rs1 < rs2 ? 1 : 0);
+      break;
+   case op_xor:
+      set_reg(d.rd, rs1 ^ rs2);
+      break;
+   case op_srl:
+      set_reg(d.rd, rs1 >> (rs2 & 0x3F));
+      break;
+   case op_sra:
+      set_reg(d.rd, (int64_t)rs1 >> (rs2 & 0x3F));
+      break;
+   case op_or:
+      set_reg(d.rd, rs1 | rs2);
+      break;
+   case op_and:
+      set_reg(d.rd, rs1 & rs2);
+      break;
+   case op_mul:
+      set_reg(d.rd, rs1 * rs2);
+      break;
+   case op_mulh:
+      set_reg(d.rd, ((int128)(int64_t)rs1 * (int64_t)rs2) >> 64);
+      break;
+   case op_mulhsu:
+      set_reg(d.rd, ((int128)(int64_t)rs1 * (int128)rs2) >> 64);
+      break;
+   case op_mulhu:
+      set_reg(d.rd, ((uint128)rs1 * rs2) >> 64);
+      break;
+   // Division by zero and overflow give the results the specification defines rather than trapping
+   case op_div:
+      if (rs2 == 0)
+      {
+         set_reg(d.rd, ~(uint64_t)0);
+      }
+      else if ((int64_t)rs1 == INT64_MIN && (int64_t)rs2 == -1)
+      {
+         set_reg(d.rd, rs1);
+      }
+      else
+      {
+         set_reg(d.rd, (int64_t)rs1 / (int64_t)rs2);
+      }
+      break;
+   case op_divu:
+      set_reg(d.rd, rs2 == 0 ? ~(uint64_t)0 : rs1 / rs2);
+      break;
+   case op_rem:
+      if (rs2 == 0)
+      {
+         set_reg(d.rd, rs1);
+      }
+      else if ((int64_t)rs1 == INT64_MIN && (int64_t)rs2 == -1)
+      {
+         set_reg(d.rd, 0);
+      }
+      else
+      {
+         set_reg(d.rd, (int64_t)rs1 % (int64_t)rs2);
+      }
+      break;
+   case op_remu:
+      set_reg(d.rd, rs2 == 0 ? rs1 : rs1 % rs2);
+      break;
+   case op_mulw:
+      set_reg(d.rd, (int64_t)(int32_t)(rs1 * rs2));
+      break;
+   case op_divw:
+   {
+      int32_t dividend = rs1;
+      int32_t divisor = rs2;
+      if (divisor == 0)
+      {
+         set_reg(d.rd, ~(uint64_t)0);
+      }
+      else if (dividend == INT32_MIN && divisor == -1)
+      {
+         set_reg(d.rd, (int64_t)dividend);
+      }
+      else
+      {
+         set_reg(d.rd, (int64_t)(dividend / divisor));
+      }
+   }
+   break;
+   case op_divuw:
+      set_reg(d.rd, (uint32_t)rs2 == 0 ? ~(uint64_t)0 : (int64_t)(int32_t)((uint32_t)rs1 / (uint32_t)rs2));
+      break;
+   case op_remw:
+   {
+      int32_t dividend = rs1;
+      int32_t divisor = rs2;
+      if (divisor == 0)
+      {
+         set_reg(d.rd, (int64_t)dividend);
+      }
+      else if (dividend == INT32_MIN && divisor == -1)
+      {
+         set_reg(d.rd, 0);
+      }
+      else
+      {
+         set_reg(d.rd, (int64_t)(dividend % divisor));
+      }
+   }
+   break;
+   case op_remuw:
+      set_reg(d.rd, (int64_t)(int32_t)((uint32_t)rs2 == 0 ? (uint32_t)rs1 : (uint32_t)rs1 % (uint32_t)rs2));
+      break;
+   case op_addiw:
+      set_reg(d.rd, (int64_t)(int32_t)(rs1 + d.imm));
+      break;
+   case op_slliw:
+      set_reg(d.rd, (int64_t)(int32_t)(rs1 << d.imm));
+      break;
+   case op_srliw:
+      set_reg(d.rd, (int64_t)(int32_t)((uint32_t)rs1 >> d.imm));
+      break;
+   case op_sraiw:
+      set_reg(d.rd, (int64_t)((int32_t)rs1 >> d.imm));
+      break;
+   case op_addw:
+      set_reg(d.rd, (int64_t)(int32_t)(rs1 + rs2));
+      break;
+   case op_subw:
+      set_reg(d.rd, (int64_t)(int32_t)(rs1 - rs2));
+      break;
+   case op_sllw:
+      set_reg(d.rd, (int64_t)(int32_t)(rs1 << (rs2 & 0x1F)));
+      break;
+   case op_srlw:
+      set_reg(d.rd, (int64_t)(int32_t)((uint32_t)rs1 >> (rs2 & 0x1F)));
+      break;
+   case op_sraw:
+      set_reg(d.rd, (int64_t)((int32_t)rs1 >> (rs2 & 0x1F)));
+      break;
+   case op_ecall:
+      // Environment calls from user, supervisor and machine mode are causes 8, 9 and 11
+      exception_handling(8 + prv, 0, length);
+      if (stop_on_ecall)
+      {
+         stop_requested = true;
+      }
+      break;
+   case op_ebreak:
+   {
+      if (prv != 3 && (csr_register[csr_medeleg] & (1 << 3)))
+      {
+         exception_handling(3, pc, length);
+         break;
+      }
+      set_csr(0x341, pc);
+      set_csr(0x342, 3);
+      uint64_t base = csr_register[csr_mtvec] & 0xfffffffffffffffc;
+      uint64_t inter = (csr_register[csr_mcause] & 0x8000000000000000) >> 63;
+      set_pc(base + (4 * inter) - length);
+      uint64_t mstatus = csr_register[csr_mstatus];
+      uint64_t mie = (mstatus >> 3) & 1;
+      mstatus &= 0xffffffffffffe777;
+      mstatus |= (prv << 11) | (mie << 7);
+      set_csr(0x300, mstatus);
+      prv = 3;
+      update_interrupt_pending();
+      update_translation();
+      instruction_count--;
+      trap_counts[3]++;
+      trap_taken = true;
+      if (timing != NULL)
+      {
+         timing->trap();
+      }
+   }
+   break;
+   case op_mret:
+      // Only machine mode may return from a machine trap
+      if (prv != 3)
+      {
+         exception_handling(2, d.raw, length);
+      }
+      else
+      {
+         set_pc(csr_register[csr_mepc] - length);
+         uint64_t mstatus = csr_register[csr_mstatus];
+         prv = (mstatus >> 11) & 0x3;
+         if (prv != 3)
+         {
+            mstatus &= ~mstatus_mprv;
+         }
+         uint64_t temp = (mstatus & 0x80) >> 4;
+         set_csr(0x300, (mstatus & 0xffffffffffffe777) | (temp | 0x0000000000000080));
+      }
+      break;
+   case op_sret:
+      if (prv == 0)
+      {
+         exception_handling(2, d.raw, length);
+      }
+      else
+      {
+         set_pc(csr_register[csr_sepc] - length);
+         uint64_t mstatus = csr_register[csr_mstatus];
+         prv = (mstatus & mstatus_spp) >> 8;
+         mstatus &= ~(mstatus_sie | mstatus_spp | mstatus_mprv);
+         mstatus |= ((mstatus & mstatus_spie) >> 4) | mstatus_spie;
+         set_csr(0x300, mstatus);
+      }
+      break;
+   case op_wfi:
+      // Execution simply continues, as if an interrupt had woken the hart at once
+      break;
+   case op_fence:
+      // Every memory access is already sequentially consistent
+      break;
+   case op_fence_i:
+      // Writes to decoded code are already seen, but drop every decoded instruction and block
+      // anyway, at the next block or instruction boundary as SFENCE.VMA does
+      all_code_stale = true;
+      decode_generation = ~(uint64_t)0;
+      break;
+   case op_sfence_vma:
+      if (prv == 0)
+      {
+         exception_handling(2, d.raw, length);
+      }
+      else
+      {
+         flush_translations();
+      }
+      break;
+   case op_csrrw:
+   case op_csrrs:
+   case op_csrrc:
+   case op_csrrwi:
+   case op_csrrsi:
+   case op_csrrci:
+   {
+      uint16_t csr = d.imm;
+      // Bits 9-8 of a CSR number give the lowest privilege that may access it
+      if (prv < ((csr >> 8) & 3) || csr_slot[csr] < 0 || (csr_table[csr_slot[csr]].read_only && d.rs1 != 0))
+      {
+         exception_handling(2, d.raw, length);
+         break;
+      }
+      bool read_only = csr_table[csr_slot[csr]].read_only;
+      uint64_t old_value = read_csr(csr_slot[csr]);
+      uint64_t temp;
+      switch (op)
+      {
+      case op_csrrw:
+         temp = rs1;
+         break;
+      case op_csrrs:
+         temp = old_value | rs1;
+         break;
+      case op_csrrc:
+         temp = old_value & ~rs1;
+         break;
+      case op_csrrwi:
+         temp = d.rs1;
+         break;
+      case op_csrrsi:
+         temp = old_value | d.rs1;
+         break;
+      default:
+         temp = old_value & ~(uint64_t)d.rs1;
+         break;
+      }
+      set_reg(d.rd, old_value);
+      if (csr == 0x344)
+      {
+         temp &= 0x333;
+         // With a CLINT, the timer and software interrupt bits (7 and 3) follow it, not writes
+         if (timer != NULL)
+         {
+            temp |= csr_register[csr_mip] & 0x88;
+         }
+      }
+      // CSRRW/CSRRWI report writes to read-only CSRs, the set/clear forms leave them alone
+      if (!read_only || op == op_csrrw || op == op_csrrwi)
+      {
+         set_csr(csr, temp);
+      }
+   }
+   break;
+   default:
+      exception_handling(2, d.raw, length);
+      break;
+   }
+}
+
+template <uint8_t op>
+void processor::handler(processor &cpu, const decoded_instruction &d)
+{
+   cpu.execute_op(op, d);
+}
+
+// Handlers indexed by handler id, in the order of decoded_op
+const processor::instruction_handler processor::handler_table[op_count] = {
+    &handler<op_undecoded>, &handler<op_illegal>,
+    &handler<op_lui>, &handler<op_auipc>, &handler<op_jal>, &handler<op_jalr>,
+    &handler<op_beq>, &handler<op_bne>, &handler<op_blt>, &handler<op_bge>, &handler<op_bltu>, &handler<op_bgeu>,
+    &handler<op_lb>, &handler<op_lh>, &handler<op_lw>, &handler<op_ld>, &handler<op_lbu>, &handler<op_lhu>, &handler<op_lwu>,
+    &handler<op_sb>, &handler<op_sh>, &handler<op_sw>, &handler<op_sd>,
+    &handler<op_addi>, &handler<op_slti>, &handler<op_sltiu>, &handler<op_xori>, &handler<op_ori>, &handler<op_andi>,
+    &handler<op_slli>, &handler<op_srli>, &handler<op_srai>,
+    &handler<op_add>, &handler<op_sub>, &handler<op_sll>, &handler<op_slt>, &handler<op_sltu>,
+    &handler<op_xor>, &handler<op_srl>, &handler<op_sra>, &handler<op_or>, &handler<op_and>,
+    &handler<op_addiw>, &handler<op_slliw>, &handler<op_srliw>, &handler<op_sraiw>,
+    &handler<op_addw>, &handler<op_subw>, &handler<op_sllw>, &handler<op_srlw>, &handler<op_sraw>,
+    &handler<op_ecall>, &handler<op_ebreak>, &handler<op_mret>,
+    &handler<op_csrrw>, &handler<op_csrrs>, &handler<op_csrrc>, &handler<op_csrrwi>, &handler<op_csrrsi>, &handler<op_csrrci>,
+    &handler<op_lr_w>, &handler<op_lr_d>, &handler<op_sc_w>, &handler<op_sc_d>,
+    &handler<op_amoswap_w>, &handler<op_amoadd_w>, &handler<op_amoxor_w>, &handler<op_amoand_w>, &handler<op_amoor_w>,
+    &handler<op_amomin_w>, &handler<op_amomax_w>, &handler<op_amominu_w>, &handler<op_amomaxu_w>,
+    &handler<op_amoswap_d>, &handler<op_amoadd_d>, &handler<op_amoxor_d>, &handler<op_amoand_d>, &handler<op_amoor_d>,
+    &handler<op_amomin_d>, &handler<op_amomax_d>, &handler<op_amominu_d>, &handler<op_amomaxu_d>,
+    &handler<op_mul>, &handler<op_mulh>, &handler<op_mulhsu>, &handler<op_mulhu>, &handler<op_mulw>,
+    &handler<op_div>, &handler<op_divu>, &handler<op_rem>, &handler<op_remu>,
+    &handler<op_divw>, &handler<op_divuw>, &handler<op_remw>, &handler<op_remuw>,
+    &handler<op_sret>, &handler<op_wfi>, &handler<op_sfence_vma>,
+    &handler<op_fence>, &handler<op_fence_i>};
+
+void processor::set_block_mode(bool enabled)
+{
+   block_mode = enabled;
+}
+
+void processor::set_stop_on_ecall(bool enabled)
+{
+   stop_on_ecall = enabled;
+}
+
+// Timing class of each handler id, in the order of decoded_op
+const timing_class processor::timing_classes[op_count] = {
+    tc_system, tc_system,
+    tc_upper, tc_upper, tc_jal, tc_jalr,
+    tc_branch, tc_branch, tc_branch, tc_branch, tc_branch, tc_branch,
+    tc_load, tc_load, tc_load, tc_load, tc_load, tc_load, tc_load,
+    tc_store, tc_store, tc_store, tc_store,
+    tc_alu_ri, tc_alu_ri, tc_alu_ri, tc_alu_ri, tc_alu_ri, tc_alu_ri, tc_alu_ri, tc_alu_ri, tc_alu_ri,
+    tc_alu_rr, tc_alu_rr, tc_alu_rr, tc_alu_rr, tc_alu_rr, tc_alu_rr, tc_alu_rr, tc_alu_rr, tc_alu_rr, tc_alu_rr,
+    tc_alu_ri, tc_alu_ri, tc_alu_ri, tc_alu_ri,
+    tc_alu_rr, tc_alu_rr, tc_alu_rr, tc_alu_rr, tc_alu_rr,
+    tc_system, tc_system, tc_mret,
+    tc_csr_r, tc_csr_r, tc_csr_r, tc_csr_i, tc_csr_i, tc_csr_i,
+    tc_load, tc_load, tc_atomic, tc_atomic,
+    tc_atomic, tc_atomic, tc_atomic, tc_atomic, tc_atomic, tc_atomic, tc_atomic, tc_atomic, tc_atomic,
+    tc_atomic, tc_atomic, tc_atomic, tc_atomic, tc_atomic, tc_atomic, tc_atomic, tc_atomic, tc_atomic,
+    tc_alu_rr, tc_alu_rr, tc_alu_rr, tc_alu_rr, tc_alu_rr,
+    tc_alu_rr, tc_alu_rr, tc_alu_rr, tc_alu_rr, tc_alu_rr, tc_alu_rr, tc_alu_rr, tc_alu_rr,
+    tc_mret, tc_system, tc_system,
+    tc_system, tc_system};
+
+void processor::set_timing_model(pipeline_model *model)
+{
+   timing = model;
+}
+
+void processor::set_cache_model(cache_hierarchy *model)
+{
+   caches = model;
+}
+
+void processor::set_branch_predictor(branch_predictor *model)
+{
+   predictor = model;
+}
+
+void processor::set_profiler(profiler *model)
+{
+   profile = model;
+}
+
+void processor::set_trace(trace_writer *writer)
+{
+   trace = writer;
+}
+
+void processor::set_clint(clint *device)
+{
+   timer = device;
+   timer_changed();
+}
+
+// Set the machine timer and software interrupt pending bits from the CLINT, and work out the
+// instruction count at which the timer bit next changes. Until then, only a write to the
+// CLINT can change either bit.
+void processor::update_timer()
+{
+   uint64_t deadline = ~(uint64_t)0;
+   timer_deadline.store(deadline, memory_order_relaxed);
+   uint64_t hart = csr_register[csr_mhartid];
+   uint64_t mip = csr_register[csr_mip] & ~(uint64_t)0x88;
+   uint64_t now = timer->get_mtime(instruction_count);
+   uint64_t compare = timer->get_mtimecmp(hart);
+   if (now >= compare)
+   {
+      mip |= 0x80;
+   }
+   else
+   {
+      deadline = instruction_count + (compare - now);
+   }
+   if (timer->get_msip(hart))
+   {
+      mip |= 0x8;
+   }
+   csr_register[csr_mip] = mip;
+   update_interrupt_pending();
+   // A write from another hart since the start leaves the deadline at 0, to look again
+   uint64_t expected = ~(uint64_t)0;
+   timer_deadline.compare_exchange_strong(expected, deadline, memory_order_relaxed);
+}
+
+uint64_t processor::get_instruction_count()
+{
+   return instruction_count;
+}
+
+void processor::save_state(vector<uint8_t> &out)
+{
+   checkpoint_put(out, pc);
+   checkpoint_put(out, prv);
+   checkpoint_put(out, breakpoint);
+   checkpoint_put(out, instruction_count);
+   for (int i = 0; i < 32; i++)
+   {
+      checkpoint_put(out, registers[i]);
+   }
+   // CSRs by number, so checkpoints do not depend on the order of the CSR table. Views of
+   // other CSRs hold nothing of their own.
+   uint64_t stored = 0;
+   for (int i = 0; i < csr_count; i++)
+   {
+      stored += csr_table[i].view == csr_count;
+   }
+   checkpoint_put(out, stored);
+   for (int i = 0; i < csr_count; i++)
+   {
+      if (csr_table[i].view == csr_count)
+      {
+         checkpoint_put(out, csr_table[i].number);
+         checkpoint_put(out, csr_register[i]);
+      }
+   }
+   // The CLINT registers for this hart, if there is one
+   if (timer != NULL)
+   {
+      uint64_t timer_state[3];
+      timer->get_state(csr_register[csr_mhartid], timer_state);
+      for (int i = 0; i < 3; i++)
+      {
+         checkpoint_put(out, timer_state[i]);
+      }
+   }
+}
+
+bool processor::restore_state(const uint8_t *data, uint64_t length, bool apply)
+{
+   const uint8_t *in = data;
+   const uint8_t *end = data + length;
+   uint64_t new_pc = 0, new_prv = 0, new_breakpoint = 0, new_count = 0, new_registers[32], csrs = 0;
+   bool valid = checkpoint_get(in, end, new_pc) && checkpoint_get(in, end, new_prv) &&
+                checkpoint_get(in, end, new_breakpoint) && checkpoint_get(in, end, new_count);
+   for (int i = 0; i < 32 && valid; i++)
+   {
+      valid = checkpoint_get(in, end, new_registers[i]);
+   }
+   valid = valid && checkpoint_get(in, end, csrs) && (new_prv == 0 || new_prv == 1 || new_prv == 3) &&
+                new_registers[0] == 0;
+   uint64_t new_csrs[csr_count];
+   for (int i = 0; i < csr_count; i++)
+   {
+      new_csrs[i] = csr_table[i].reset_value;
+   }
+   for (uint64_t i = 0; i < csrs && valid; i++)
+   {
+      uint64_t number, value;
+      valid = checkpoint_get(in, end, number) && checkpoint_get(in, end, value) && number < 4096 &&
+              csr_slot[number] >= 0;
+      if (valid)
+      {
+         new_csrs[csr_slot[number]] = value;
+      }
+   }
+   uint64_t timer_state[3];
+   bool timer_saved = valid && in != end;
+   for (int i = 0; i < 3 && timer_saved; i++)
+   {
+      valid = checkpoint_get(in, end, timer_state[i]);
+   }
+   if (!valid || in != end || !apply)
+   {
+      return valid && in == end;
+   }
+
+   pc = new_pc;
+   prv = new_prv;
+   breakpoint = new_breakpoint;
+   instruction_count = new_count;
+   for (int i = 0; i < 32; i++)
+   {
+      registers[i] = new_registers[i];
+   }
+   for (int i = 0; i < csr_count; i++)
+   {
+      csr_register[i] = new_csrs[i];
+   }
+   update_interrupt_pending();
+   flush_translations();
+   update_translation();
+   if (timer != NULL)
+   {
+      if (timer_saved)
+      {
+         timer->set_state(csr_register[csr_mhartid], timer_state);
+      }
+      timer_changed();
+   }
+
+   return true;
+}
+
+void processor::print_instruction_mix(ostream &out, bool json)
+{
+   for (int i = 0; i < 3; i++)
+   {
+      for (unordered_map<uint64_t, translated_block>::iterator it = code_caches[i].blocks.begin();
+           it != code_caches[i].blocks.end(); ++it)
+      {
+         count_block(it->second);
+      }
+   }
+
+   // Each class is a range of handler ids and one more id, with op_undecoded (never
+   // executed) standing for none
+   struct mix_class
+   {
+      const char *name;
+      const char *key;
+      uint8_t first;
+      uint8_t last;
+      uint8_t other;
+   };
+   static const mix_class classes[] = {
+       {"ALU", "alu", op_addi, op_and, op_undecoded},
+       {"ALU word", "alu_w", op_addiw, op_sraw, op_undecoded},
+       {"Upper immediate", "upper", op_lui, op_auipc, op_undecoded},
+       {"Load byte", "load_byte", op_lb, op_lb, op_lbu},
+       {"Load halfword", "load_halfword", op_lh, op_lh, op_lhu},
+       {"Load word", "load_word", op_lw, op_lw, op_lwu},
+       {"Load doubleword", "load_doubleword", op_ld, op_ld, op_undecoded},
+       {"Store byte", "store_byte", op_sb, op_sb, op_undecoded},
+       {"Store halfword", "store_halfword", op_sh, op_sh, op_undecoded},
+       {"Store word", "store_word", op_sw, op_sw, op_undecoded},
+       {"Store doubleword", "store_doubleword", op_sd, op_sd, op_undecoded},
+       {"LR/SC", "lr_sc", op_lr_w, op_sc_d, op_undecoded},
+       {"AMO", "amo", op_amoswap_w, op_amomaxu_d, op_undecoded},
+       {"Multiply", "multiply", op_mul, op_mulw, op_undecoded},
+       {"Divide", "divide", op_div, op_remuw, op_undecoded},
+       {"JAL", "jal", op_jal, op_jal, op_undecoded},
+       {"JALR", "jalr", op_jalr, op_jalr, op_undecoded},
+       {"CSR", "csr", op_csrrw, op_csrrci, op_undecoded},
+       {"ECALL", "ecall", op_ecall, op_ecall, op_undecoded},
+       {"EBREAK", "ebreak", op_ebreak, op_ebreak, op_undecoded},
+       {"MRET", "mret", op_mret, op_mret, op_undecoded},
+       {"SRET", "sret", op_sret, op_sret, op_undecoded},
+       {"WFI", "wfi", op_wfi, op_wfi, op_undecoded},
+       {"SFENCE.VMA", "sfence_vma", op_sfence_vma, op_sfence_vma, op_undecoded},
+       {"FENCE", "fence", op_fence, op_fence, op_undecoded},
+       {"FENCE.I", "fence_i", op_fence_i, op_fence_i, op_undecoded},
+       {"Illegal", "illegal", op_illegal, op_illegal, op_undecoded}};
+   vector<pair<string, uint64_t> > counts;
+   for (unsigned int i = 0; i < sizeof(classes) / sizeof(classes[0]); i++)
+   {
+      uint64_t count = op_counts[classes[i].other];
+      for (unsigned int op = classes[i].first; op <= classes[i].last; op++)
+      {
+         count += op_counts[op];
+      }
+      counts.push_back(make_pair(json ? classes[i].key : classes[i].name, count));
+   }
+   uint64_t branches = 0;
+   for (unsigned int op = op_beq; op <= op_bgeu; op++)
+   {
+      branches += op_counts[op];
+   }
+   counts.push_back(make_pair(json ? "branch_taken" : "Branch taken", branches_taken));
+   counts.push_back(make_pair(json ? "branch_not_taken" : "Branch not taken", branches - branches_taken));
+
+   if (json)
+   {
+      out << "{\"instructions\": " << dec << instruction_count << ", \"classes\": {";
+      for (unsigned int i = 0; i < counts.size(); i++)
+      {
+         out << (i == 0 ? "" : ", ") << "\"" << counts[i].first << "\": " << counts[i].second;
+      }
+      const char *groups[2] = {"traps", "interrupts"};
+      uint64_t *group_counts[2] = {trap_counts, interrupt_counts};
+      for (unsigned int group = 0; group < 2; group++)
+      {
+         out << "}, \"" << groups[group] << "\": {";
+         bool first = true;
+         for (unsigned int cause = 0; cause < 16; cause++)
+         {
+            if (group_counts[group][cause] != 0)
+            {
+               out << (first ? "" : ", ") << "\"" << cause << "\": " << group_counts[group][cause];
+               first = false;
+            }
+         }
+      }
+      out << "}}" << endl;
+      return;
+   }
+
+   out << "Instruction mix (including instructions that trap):" << endl;
+   for (unsigned int i = 0; i < counts.size(); i++)
+   {
+      out << "  " << counts[i].first << ": " << dec << counts[i].second << endl;
+   }
+   for (unsigned int cause = 0; cause < 16; cause++)
+   {
+      if (trap_counts[cause] != 0)
+      {
+         out << "  Traps with cause " << cause << ": " << trap_counts[cause] << endl;
+      }
+   }
+   for (unsigned int cause = 0; cause < 16; cause++)
+   {
+      if (interrupt_counts[cause] != 0)
+      {
+         out << "  Interrupts with cause " << cause << ": " << interrupt_counts[cause] << endl;
+      }
+   }
 }
 
 uint64_t processor::get_cycle_count()
 {
-   return 0;
+   if (timing == NULL)
+   {
+      return 0;
+   }
+   return timing->get_cycles();
 }
@@ -10,10 +10,20 @@
 **************************************************************** */
 
 #include "memory.h"
+#include "pipeline.h"
+#include "cache.h"
+#include "predictor.h"
+#include "profiler.h"
+#include "trace.h"
 #include <set>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
 
 using namespace std;
 
+class clint;
+
 class processor
 {
 
@@ -29,8 +39,236 @@ private:
    uint64_t breakpoint;
    uint64_t registers[32];
    int64_t instruction_count;
-   unordered_map<uint16_t, uint64_t> csr_register;
-   
+
+   // Implemented CSRs, indexing csr_register and csr_table
+   enum csr_id
+   {
+      csr_mvendorid, csr_marchid, csr_mimpid, csr_mhartid,
+      csr_mstatus, csr_misa, csr_mie, csr_mtvec,
+      csr_mscratch, csr_mepc, csr_mcause, csr_mtval, csr_mip,
+      csr_medeleg, csr_mideleg,
+      csr_sstatus, csr_sie, csr_stvec, csr_sscratch, csr_sepc, csr_scause, csr_stval, csr_sip,
+      csr_satp,
+      csr_count
+   };
+
+   // Number, reset value and WARL behaviour of an implemented CSR. A view (sstatus, sie and
+   // sip) has no value of its own, but shows the write_mask and set_bits bits of another CSR.
+   struct csr_description
+   {
+      uint16_t number;
+      uint64_t reset_value;
+      uint64_t write_mask;
+      uint64_t set_bits;
+      bool read_only;
+      csr_id view;
+   };
+
+   static const csr_description csr_table[csr_count];
+   uint64_t csr_register[csr_count];
+   // csr_id of each CSR number, or -1 if the CSR is not implemented
+   int8_t csr_slot[4096];
+
+   // Handler ids for decoded instructions. op_undecoded marks an empty decode cache entry.
+   enum decoded_op : uint8_t
+   {
+      op_undecoded, op_illegal,
+      op_lui, op_auipc, op_jal, op_jalr,
+      op_beq, op_bne, op_blt, op_bge, op_bltu, op_bgeu,
+      op_lb, op_lh, op_lw, op_ld, op_lbu, op_lhu, op_lwu,
+      op_sb, op_sh, op_sw, op_sd,
+      op_addi, op_slti, op_sltiu, op_xori, op_ori, op_andi, op_slli, op_srli, op_srai,
+      op_add, op_sub, op_sll, op_slt, op_sltu, op_xor, op_srl, op_sra, op_or, op_and,
+      op_addiw, op_slliw, op_srliw, op_sraiw,
+      op_addw, op_subw, op_sllw, op_srlw, op_sraw,
+      op_ecall, op_ebreak, op_mret,
+      op_csrrw, op_csrrs, op_csrrc, op_csrrwi, op_csrrsi, op_csrrci,
+      op_lr_w, op_lr_d, op_sc_w, op_sc_d,
+      op_amoswap_w, op_amoadd_w, op_amoxor_w, op_amoand_w, op_amoor_w,
+      op_amomin_w, op_amomax_w, op_amominu_w, op_amomaxu_w,
+      op_amoswap_d, op_amoadd_d, op_amoxor_d, op_amoand_d, op_amoor_d,
+      op_amomin_d, op_amomax_d, op_amominu_d, op_amomaxu_d,
+      op_mul, op_mulh, op_mulhsu, op_mulhu, op_mulw,
+      op_div, op_divu, op_rem, op_remu, op_divw, op_divuw, op_remw, op_remuw,
+      op_sret, op_wfi, op_sfence_vma,
+      op_fence, op_fence_i,
+      op_count
+   };
+
+   struct decoded_instruction;
+   typedef void (*instruction_handler)(processor &cpu, const decoded_instruction &d);
+
+   // Compact decoded form of an instruction, with the handler that executes it bound at decode.
+   // For CSR instructions imm holds the CSR number, and rs1 doubles as the zero-extended
+   // immediate of the CSR*I forms. A compressed instruction is decoded as the instruction it
+   // expands to, with raw holding its 16-bit encoding.
+   struct decoded_instruction
+   {
+      instruction_handler handler;
+      uint8_t op;
+      uint8_t rd;
+      uint8_t rs1;
+      uint8_t rs2;
+      uint32_t raw;
+      int64_t imm;
+      decoded_instruction() : handler(NULL), op(op_undecoded), rd(0), rs1(0), rs2(0), raw(0), imm(0) {}
+   };
+
+   // Length in bytes of a decoded instruction: 2 if it is compressed, otherwise 4
+   static unsigned int instruction_length(const decoded_instruction &d) { return (d.raw & 3) == 3 ? 4 : 2; }
+
+   // A straight-line run of decoded instructions, chained to the blocks that follow it
+   struct translated_block
+   {
+      uint64_t start;
+      // Address following the last instruction
+      uint64_t end;
+      // Target of a final direct branch or jump, or 1 (never a valid PC) if there is none
+      uint64_t taken_pc;
+      vector<decoded_instruction> instructions;
+      // Successors at taken_pc and end, filled in when first followed
+      translated_block *taken;
+      translated_block *fallthrough;
+      // Set if any of the instructions is compressed, so they are not all 4 bytes apart
+      bool compressed;
+      // Complete runs of the block, and those leaving it at taken_pc, not yet added to the
+      // instruction mix
+      uint64_t runs;
+      uint64_t taken_runs;
+   };
+
+   // Decoded instructions of a 2Kbyte page of the address space, 1024 entries (one per
+   // halfword), and the address of the memory page holding them
+   struct decoded_page
+   {
+      uint64_t physical;
+      vector<decoded_instruction> instructions;
+   };
+
+   // Decoded instructions and translated blocks by the address they are fetched from, for
+   // one way of fetching
+   struct code_cache
+   {
+      unordered_map<uint64_t, decoded_page> pages;
+      // Most recently used page, to avoid a hash lookup for sequential fetches
+      uint64_t last_page_address;
+      decoded_instruction *last_page;
+      unordered_map<uint64_t, translated_block> blocks;
+   };
+
+   // Code caches for physical fetches, and for fetches translated in supervisor and user
+   // mode, which may see different code at the same address; and the one in use
+   code_cache code_caches[3];
+   code_cache *code;
+   // Memory code generation the code caches are consistent with
+   uint64_t decode_generation;
+   // Set in decode_generation to make the block loop stop after the current instruction, as a
+   // write to decoded code does, but without a flush
+   static const uint64_t leave_block = 1ULL << 63;
+   // Set when the translated code caches, or all code caches, are to be dropped at the next flush
+   bool translated_code_stale;
+   bool all_code_stale;
+   // Whether execute runs a block at a time
+   bool block_mode;
+   // Whether execute returns once an ECALL has been taken, and whether it should return
+   // after the current instruction
+   bool stop_on_ecall;
+   bool stop_requested;
+
+   // Instruction mix: executions of each handler id, including instructions that trap, taken
+   // conditional branches, and traps and interrupts by cause. Complete block runs are counted
+   // in the blocks and added in by count_block.
+   uint64_t op_counts[op_count];
+   uint64_t branches_taken;
+   uint64_t trap_counts[16];
+   uint64_t interrupt_counts[16];
+   void count_block(translated_block &block);
+
+   // Cycle model, or NULL if cycles are not being counted
+   pipeline_model *timing;
+   static const timing_class timing_classes[op_count];
+   // Cache model, or NULL if caches are not being modelled
+   cache_hierarchy *caches;
+   // Branch predictor model, or NULL if branch prediction is not being modelled
+   branch_predictor *predictor;
+   // Execution profiler, or NULL if not profiling
+   profiler *profile;
+   // Execution trace, or NULL if not tracing
+   trace_writer *trace;
+   // Set when the current instruction traps rather than retiring
+   bool trap_taken;
+   void observe(const decoded_instruction &d, uint64_t instruction_pc, uint64_t data_address);
+   void profile_jump(const decoded_instruction &d);
+   void trace_instruction(const decoded_instruction &d, uint64_t instruction_pc, uint64_t data_address);
+
+   static const instruction_handler handler_table[op_count];
+   template <uint8_t op>
+   static void handler(processor &cpu, const decoded_instruction &d);
+   void execute_op(uint8_t op, const decoded_instruction &d);
+
+   // Set when interrupts are enabled and one of them is pending
+   bool interrupt_pending;
+   // The CLINT, if any, and the instruction count at which the timer interrupt next changes,
+   // or 0 when the CLINT has been written and must be looked at again
+   clint *timer;
+   atomic<uint64_t> timer_deadline;
+   void update_timer();
+   void update_interrupt_pending();
+   void take_pending_interrupt();
+   template <bool observed, bool profiled>
+   bool execute_instructions(unsigned int num, bool breakpoint_check);
+   template <bool observed, bool profiled>
+   bool execute_blocks(unsigned int num, bool breakpoint_check);
+   translated_block *lookup_block(uint64_t address);
+   static bool ends_block(uint8_t op);
+   const decoded_instruction *fetch_decoded(uint64_t address);
+   void flush_decode_cache();
+   decoded_instruction decode(uint32_t instruction);
+
+   // Sv39 address translation, through a direct-mapped software TLB for each kind of access.
+   // An entry maps a 2Kbyte virtual page to a memory page and its host address. The tags
+   // also hold the privilege and the mstatus bits the translation was checked for, so
+   // changing them needs no flush. Untranslated loads and stores use the TLBs too, for the
+   // host address.
+   enum access_type
+   {
+      access_fetch, access_load, access_store
+   };
+   struct tlb_entry
+   {
+      uint64_t tag;
+      uint64_t physical;
+      uint8_t *host;
+   };
+   static const unsigned int tlb_size = 256;
+   tlb_entry tlbs[3][tlb_size];
+   // Whether fetches and data accesses are translated, the privilege data accesses are made
+   // at, and the tag bits for the current privilege and mstatus
+   bool fetch_translated;
+   bool data_translated;
+   uint64_t data_privilege;
+   uint64_t fetch_context;
+   uint64_t data_context;
+   // Virtual address of the last fetch that could not be translated
+   uint64_t fetch_fault_address;
+   void update_translation();
+   void flush_translations();
+   tlb_entry *translate(uint64_t address, access_type type);
+   tlb_entry *fill_tlb(uint64_t address, access_type type);
+   // Entry returned for an access to a device, which is never entered in a TLB
+   tlb_entry device_entry;
+   bool access_uncached(uint64_t address, access_type type, uint64_t &data, unsigned int bytes, unsigned int length);
+   bool walk_page_table(uint64_t address, access_type type, uint64_t &physical);
+   template <typename T>
+   bool load(uint64_t address, T &value, unsigned int length);
+   template <typename T>
+   bool store(uint64_t address, T value, unsigned int length);
+   bool translate_atomic(uint64_t &address, bool loading, unsigned int length);
+
+   uint64_t read_csr(int slot);
+   uint64_t enabled_interrupts();
+   uint64_t supervisor_trap(uint64_t cause, uint64_t value);
+
 public:
    // Consructor
    processor(memory *main_memory, bool verbose, bool stage2);
@@ -51,8 +289,9 @@ public:
    // Set register to new value
    void set_reg(unsigned int reg_num, uint64_t new_value);
 
-   // Execute a number of instructions
-   void execute(unsigned int num, bool breakpoint_check);
+   // Execute a number of instructions. Return true if execution stopped early, at the
+   // breakpoint, after an ECALL with set_stop_on_ecall or because a device halted the machine.
+   bool execute(unsigned int num, bool breakpoint_check);
 
    // Clear breakpoint
    void clear_breakpoint();
@@ -60,11 +299,16 @@ public:
    // Set breakpoint at an address
    void set_breakpoint(uint64_t address);
 
+   // Set the hart ID read from mhartid
+   void set_hart_id(uint64_t id);
+
    void execute_instruction(uint32_t instruction);
 
    void interrupt(uint32_t cause);
 
-   void exception_handling(uint32_t cause, uint64_t instruction);
+   // Take an exception with a cause and trap value for the instruction at the PC, of length
+   // bytes, or 0 if it could not be fetched. It is taken in supervisor mode if delegated.
+   void exception_handling(uint32_t cause, uint64_t value, unsigned int length);
 
    // Show privilege level
    // Empty implementation for stage 1, required for stage 2
@@ -82,8 +326,43 @@ public:
    // Empty implementation for stage 1, required for stage 2
    void set_csr(unsigned int csr_num, uint64_t new_value);
 
+   // Select between executing a translated block at a time (the default) and
+   // executing one instruction at a time
+   void set_block_mode(bool enabled);
+
+   // Make execute return as soon as an ECALL has been executed (and its trap taken)
+   void set_stop_on_ecall(bool enabled);
+
+   // Count cycles with a pipeline model, or stop counting if model is NULL
+   void set_timing_model(pipeline_model *model);
+   // Model caches on instruction fetches, loads and stores, or stop if model is NULL
+   void set_cache_model(cache_hierarchy *model);
+   // Model branch prediction on branches and jumps, or stop if model is NULL. With a cycle
+   // model attached, only mispredictions then take the branch and jump penalties.
+   void set_branch_predictor(branch_predictor *model);
+   // Profile retired instructions and calls, or stop if model is NULL
+   void set_profiler(profiler *model);
+   // Record every executed instruction in a trace, or stop if writer is NULL
+   void set_trace(trace_writer *writer);
+   // Take timer and software interrupts from a CLINT
+   void set_clint(clint *device);
+   // Called by the CLINT when a register affecting this hart is written
+   void timer_changed() { timer_deadline.store(0, memory_order_relaxed); }
+
    uint64_t get_instruction_count();
 
+   // Append the architectural state (PC, registers, privilege level, CSRs, breakpoint and
+   // instruction count) to checkpoint data
+   void save_state(vector<uint8_t> &out);
+
+   // Check state in checkpoint data and, if apply is set, replace the current state with it.
+   // Return false if the data is not valid. Decoded code is kept, as memory reports any change
+   // to it through the code generation.
+   bool restore_state(const uint8_t *data, uint64_t length, bool apply);
+
+   // Print the instruction mix, as text or as a JSON object
+   void print_instruction_mix(ostream &out, bool json);
+
    // Used for Postgraduate assignment. Undergraduate assignment can return 0.
    uint64_t get_cycle_count();
 };
@@ -0,0 +1,217 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class members for the execution profiler
+
+**************************************************************** */
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include "profiler.h"
+
+using namespace std;
+
+// Largest span of code, in instructions, kept in the count array
+static const uint64_t max_counts = 1 << 22;
+
+profiler::profiler()
+{
+   base = 0;
+   frame root = {0, 0, 0};
+   frames.push_back(root);
+   current = 0;
+   retired = 0;
+   frame_start = 0;
+}
+
+// Count a run of instructions outside the count array, growing the array to cover it if the
+// code is not spread too widely
+void profiler::record_outside(uint64_t pc, uint64_t length)
+{
+   uint64_t entries = counts[0].size() - 1;
+   uint64_t start;
+   uint64_t end;
+   if (counts[0].empty())
+   {
+      // The first instruction also names the root of the call tree
+      frames[0].function = pc;
+      entries = 0;
+      start = pc & ~(uint64_t)0xfff;
+      end = start + 0x10000;
+   }
+   else
+   {
+      // Grow towards the instructions by at least the current size, so growing is rare
+      start = min(base, pc & ~(uint64_t)0xfff);
+      end = max(base + 4 * entries, (pc + 4 * length + 0xfff) & ~(uint64_t)0xfff);
+      if (start < base)
+      {
+         start = min(start, base > 4 * entries ? base - 4 * entries : 0);
+      }
+      if (end > base + 4 * entries)
+      {
+         end = max(end, base + 8 * entries);
+      }
+   }
+   if ((end - start) / 4 > max_counts)
+   {
+      for (uint64_t i = 0; i < length; i++)
+      {
+         outlying[pc + 4 * i]++;
+      }
+      return;
+   }
+   for (unsigned int h = 0; h < 2; h++)
+   {
+      vector<uint64_t> grown((end - start) / 4 + 1, 0);
+      if (!counts[h].empty())
+      {
+         copy(counts[h].begin(), counts[h].end(), grown.begin() + (base - start) / 4);
+      }
+      counts[h].swap(grown);
+   }
+   base = start;
+   vector<uint64_t> &half = counts[(pc >> 1) & 1];
+   half[(pc - base) >> 2]++;
+   half[((pc - base) >> 2) + length]--;
+}
+
+// Make frame the current frame, charging the instructions since the last change to the frame
+// being left
+void profiler::enter(unsigned int frame)
+{
+   frames[current].count += retired - frame_start;
+   frame_start = retired;
+   current = frame;
+}
+
+void profiler::call(uint64_t target)
+{
+   pair<unsigned int, uint64_t> key(current, target);
+   map<pair<unsigned int, uint64_t>, unsigned int>::iterator child = children.find(key);
+   if (child != children.end())
+   {
+      enter(child->second);
+      return;
+   }
+   frame callee = {target, current, 0};
+   frames.push_back(callee);
+   children[key] = frames.size() - 1;
+   enter(frames.size() - 1);
+}
+
+string profiler::frame_name(const memory *main_memory, uint64_t address)
+{
+   const memory::symbol *symbol = main_memory->find_symbol(address);
+   if (symbol != NULL && symbol->address == address)
+   {
+      return symbol->name;
+   }
+   stringstream name;
+   if (symbol != NULL)
+   {
+      name << symbol->name << "+0x" << hex << address - symbol->address;
+   }
+   else
+   {
+      name << "0x" << hex << address;
+   }
+   return name.str();
+}
+
+static bool more_counted(const pair<string, uint64_t> &a, const pair<string, uint64_t> &b)
+{
+   return a.second != b.second ? a.second > b.second : a.first < b.first;
+}
+
+void profiler::print_statistics(const memory *main_memory, unsigned int top)
+{
+   // Gather the counts per instruction and per function
+   vector<pair<uint64_t, uint64_t> > instructions;
+   for (unsigned int h = 0; h < 2; h++)
+   {
+      uint64_t count = 0;
+      for (uint64_t i = 0; i + 1 < counts[h].size(); i++)
+      {
+         count += counts[h][i];
+         if (count != 0)
+         {
+            instructions.push_back(make_pair(base + 4 * i + 2 * h, count));
+         }
+      }
+   }
+   for (unordered_map<uint64_t, uint64_t>::const_iterator i = outlying.begin(); i != outlying.end(); i++)
+   {
+      instructions.push_back(*i);
+   }
+   uint64_t total = 0;
+   map<string, uint64_t> function_counts;
+   for (unsigned int i = 0; i < instructions.size(); i++)
+   {
+      const memory::symbol *symbol = main_memory->find_symbol(instructions[i].first);
+      function_counts[symbol != NULL ? symbol->name : "[unknown]"] += instructions[i].second;
+      total += instructions[i].second;
+   }
+   if (total == 0)
+   {
+      cout << "Profile: no instructions retired" << endl;
+      return;
+   }
+
+   vector<pair<string, uint64_t> > functions(function_counts.begin(), function_counts.end());
+   sort(functions.begin(), functions.end(), more_counted);
+   cout << "Profile by function:" << endl;
+   for (unsigned int i = 0; i < functions.size() && i < top; i++)
+   {
+      cout << setw(14) << setfill(' ') << dec << functions[i].second << " " << setw(6) << fixed << setprecision(2)
+           << 100.0 * functions[i].second / total << "%  " << functions[i].first << endl;
+   }
+
+   vector<pair<string, uint64_t> > hot;
+   for (unsigned int i = 0; i < instructions.size(); i++)
+   {
+      stringstream name;
+      name << setw(16) << setfill('0') << hex << instructions[i].first;
+      const memory::symbol *symbol = main_memory->find_symbol(instructions[i].first);
+      if (symbol != NULL)
+      {
+         name << " <" << symbol->name << "+0x" << instructions[i].first - symbol->address << ">";
+      }
+      hot.push_back(make_pair(name.str(), instructions[i].second));
+   }
+   sort(hot.begin(), hot.end(), more_counted);
+   cout << "Profile by instruction:" << endl;
+   for (unsigned int i = 0; i < hot.size() && i < top; i++)
+   {
+      cout << setw(14) << setfill(' ') << dec << hot[i].second << " " << setw(6) << fixed << setprecision(2)
+           << 100.0 * hot[i].second / total << "%  " << hot[i].first << endl;
+   }
+}
+
+bool profiler::write_collapsed(string file_name, const memory *main_memory)
+{
+   ofstream file(file_name.c_str());
+   if (!file)
+   {
+      cout << "Cannot write profile file " << file_name << endl;
+      return false;
+   }
+   enter(current);
+   vector<string> names(frames.size());
+   for (unsigned int i = 0; i < frames.size(); i++)
+   {
+      // Parents are always created before their children
+      string name = frame_name(main_memory, frames[i].function);
+      names[i] = (i == 0) ? name : names[frames[i].parent] + ";" + name;
+      if (frames[i].count != 0)
+      {
+         file << names[i] << " " << frames[i].count << endl;
+      }
+   }
+   return true;
+}
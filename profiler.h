@@ -0,0 +1,96 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class for the execution profiler
+
+**************************************************************** */
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+
+#include "memory.h"
+
+using namespace std;
+
+// Counts retired instructions per PC and per call stack. The calls are tracked from JAL and
+// JALR instructions that link through x1 or x5, and returns from JALR through x1 or x5.
+class profiler
+{
+
+private:
+   // Retire counts per instruction, indexed by (pc - base) / 4 and kept as differences: a run
+   // of instructions adds one at its first instruction and subtracts one after its last, so
+   // each count is the sum of the entries up to it. There is one more entry than instructions.
+   // Compressed instructions can also start halfway through a word, so counts[1] holds those
+   // at pc % 4 == 2, over the same range as counts[0].
+   uint64_t base;
+   vector<uint64_t> counts[2];
+   // Counts for instructions too far from the rest to keep in the array
+   unordered_map<uint64_t, uint64_t> outlying;
+
+   // Call tree, with frame 0 the root
+   struct frame
+   {
+      uint64_t function;
+      unsigned int parent;
+      uint64_t count;
+   };
+   vector<frame> frames;
+   map<pair<unsigned int, uint64_t>, unsigned int> children;
+   unsigned int current;
+   // Instructions retired, and the number when the current frame was last entered
+   uint64_t retired;
+   uint64_t frame_start;
+
+   void record_outside(uint64_t pc, uint64_t length);
+   void enter(unsigned int frame);
+   string frame_name(const memory *main_memory, uint64_t address);
+
+public:
+   // Constructor
+   profiler();
+
+   // Account for a run of length 4-byte instructions from pc retiring
+   void retire(uint64_t pc, uint64_t length)
+   {
+      uint64_t index = (pc - base) >> 2;
+      vector<uint64_t> &half = counts[(pc >> 1) & 1];
+      if (index < half.size() && index + length < half.size())
+      {
+         half[index]++;
+         half[index + length]--;
+      }
+      else
+      {
+         record_outside(pc, length);
+      }
+      retired += length;
+   }
+
+   // Account for a call to target, or a return
+   void call(uint64_t target);
+   void ret()
+   {
+      if (current != 0)
+      {
+         enter(frames[current].parent);
+      }
+   }
+
+   // Print the functions and instructions that retired most often, named from the symbols in
+   // main_memory
+   void print_statistics(const memory *main_memory, unsigned int top);
+
+   // Write each call stack and its retire count, one per line with the functions separated by
+   // semicolons, as taken by flame graph tools. Return false if the file cannot be written.
+   bool write_collapsed(string file_name, const memory *main_memory);
+};
+
+#endif
@@ -8,15 +8,128 @@
 
 #include <iostream>
 #include <iomanip>
+#include <sstream>
+#include <fstream>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
 #include <stdlib.h> 
 
 #include "memory.h"
 #include "processor.h"
+#include "clint.h"
+#include "devices.h"
+#include "pipeline.h"
+#include "cache.h"
+#include "predictor.h"
+#include "profiler.h"
+#include "trace.h"
+#include "checkpoint.h"
+#include "harts.h"
 #include "commands.h"
 
 using namespace std;
 
+// Timings of one benchmark iteration, in seconds
+struct bench_timing {
+    double setup;
+    double load;
+    double execute;
+    double teardown;
+    uint64_t instructions;
+};
+
+static double seconds_since(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Run one benchmark iteration: create a memory and processor, load the image and execute
+// up to num instructions, stopping early at an ECALL or the breakpoint.
+// Output from the simulator is discarded. Return false if the image could not be loaded.
+static bool bench_iteration(string file_name, unsigned int num, bool breakpoint_present, uint64_t breakpoint,
+			    bool block_mode, bench_timing& timing) {
+    stringstream discarded;
+    streambuf* cout_buffer = cout.rdbuf(discarded.rdbuf());
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    memory* main_memory = new memory (false);
+    processor* cpu = new processor (main_memory, false, true);
+    cpu->set_block_mode(block_mode);
+    cpu->set_stop_on_ecall(true);
+    if (breakpoint_present)
+	cpu->set_breakpoint(breakpoint);
+    timing.setup = seconds_since(start);
+
+    start = chrono::steady_clock::now();
+    uint64_t start_address;
+    bool loaded = main_memory->load_file(file_name, start_address);
+    cpu->set_pc(start_address);
+    timing.load = seconds_since(start);
+
+    start = chrono::steady_clock::now();
+    if (loaded)
+	cpu->execute(num, breakpoint_present);
+    timing.execute = seconds_since(start);
+    timing.instructions = cpu->get_instruction_count();
+
+    start = chrono::steady_clock::now();
+    delete cpu;
+    delete main_memory;
+    timing.teardown = seconds_since(start);
+
+    cout.rdbuf(cout_buffer);
+    if (!loaded)
+	cout << discarded.str();
+    return loaded;
+}
+
+// Benchmark mode: run the image in file_name for warmup unreported iterations and then
+// iterations reported ones, and report the time taken by each phase and the execution rate.
+static void run_benchmark(string file_name, unsigned int num, unsigned int warmup, unsigned int iterations,
+			  bool breakpoint_present, uint64_t breakpoint, bool block_mode) {
+    vector<bench_timing> timings;
+    bench_timing timing;
+
+    for (unsigned int i = 0; i < warmup + iterations; i++) {
+	if (!bench_iteration(file_name, num, breakpoint_present, breakpoint, block_mode, timing))
+	    return;
+	if (i >= warmup)
+	    timings.push_back(timing);
+    }
+
+    cout << "Benchmark " << file_name << ": " << dec << iterations << " iterations after "
+	 << warmup << " warmup" << endl;
+    cout << fixed << setprecision(3);
+    cout << "iteration   setup ms    load ms  execute ms teardown ms  instructions       MIPS  ns/instr" << endl;
+    vector<double> rates;
+    double total_rate = 0;
+    for (unsigned int i = 0; i < timings.size(); i++) {
+	bench_timing& t = timings[i];
+	double rate = t.execute > 0 ? t.instructions / t.execute : 0;
+	rates.push_back(rate);
+	total_rate += rate;
+	cout << setfill(' ') << setw(9) << i + 1
+	     << setw(11) << t.setup * 1e3 << setw(11) << t.load * 1e3
+	     << setw(12) << t.execute * 1e3 << setw(12) << t.teardown * 1e3
+	     << setw(14) << t.instructions << setw(11) << rate / 1e6
+	     << setw(10) << (t.instructions > 0 ? t.execute * 1e9 / t.instructions : 0) << endl;
+    }
+    if (!rates.empty()) {
+	sort(rates.begin(), rates.end());
+	cout << "MIPS: best " << rates.back() / 1e6 << ", median " << rates[rates.size() / 2] / 1e6
+	     << ", mean " << total_rate / rates.size() / 1e6 << endl;
+    }
+}
+
+// Append the comma-separated settings in text to settings
+static void split_settings(const char* text, vector<string>& settings) {
+    stringstream stream(text);
+    string setting;
+    while (getline(stream, setting, ','))
+	settings.push_back(setting);
+}
+
 int main(int argc, char* argv[]) {
 
     // Values of command line options. 
@@ -24,8 +137,38 @@ int main(int argc, char* argv[]) {
     bool verbose = false;
     bool cycle_reporting = false;
     bool stage2 = false;
+    bool block_mode = true;
+    vector<string> timing_settings;
+    vector<string> cache_settings;
+    cache_hierarchy* caches = NULL;
+    vector<string> predictor_settings;
+    branch_predictor* predictor = NULL;
+    string profile_file;
+    unsigned int profile_top = 20;
+    profiler* profile = NULL;
+    vector<string> symbol_maps;
+    bool mix_reporting = false;
+    string trace_file;
+    string checkpoint_file;
+    trace_writer* trace = NULL;
+    string mix_file;
+    string bench_file;
+    unsigned int bench_num = 1000000000;
+    unsigned int bench_warmup = 1;
+    unsigned int bench_iterations = 5;
+    bool bench_breakpoint_present = false;
+    uint64_t bench_breakpoint = 0;
+    unsigned int hart_count = 1;
+    unsigned int quantum = 1000;
+    bool parallel = true;
+    bool clint_present = false;
+    clint* timer = NULL;
+    bool uart_present = false;
+    bool finisher_present = false;
+    string block_file;
 
     memory* main_memory;
+    hart_scheduler* harts;
     processor* cpu;
 
     unsigned long int cpu_instruction_count;
@@ -39,19 +182,136 @@ int main(int argc, char* argv[]) {
 	    cycle_reporting = true;
 	else if (arg == "-s2")  // Stage 2 functionality enabled
 	    stage2 = true;
+	else if (arg == "-nb")  // Execute one instruction at a time rather than by translated blocks
+	    block_mode = false;
+	else if (arg == "-timing" && i + 1 < argc)  // Cycle model penalties, as name=value,name=value...
+	    split_settings(argv[++i], timing_settings);
+	else if (arg == "-cache" && i + 1 < argc)  // Caches, as level=size:line:ways[:policy[:latency]],...
+	    split_settings(argv[++i], cache_settings);
+	else if (arg == "-bp" && i + 1 < argc)  // Branch predictor, as kind,name=value,...
+	    split_settings(argv[++i], predictor_settings);
+	else if (arg == "-profile" && i + 1 < argc)  // Profile execution, writing call stacks to a file
+	    profile_file = argv[++i];
+	else if (arg == "-profile-top" && i + 1 < argc)  // Number of hot spots reported
+	    profile_top = strtoul(argv[++i], NULL, 10);
+	else if (arg == "-stats")  // Report the instruction mix
+	    mix_reporting = true;
+	else if (arg == "-stats-json" && i + 1 < argc)  // Write the instruction mix to a JSON file
+	    mix_file = argv[++i];
+	else if (arg == "-trace" && i + 1 < argc)  // Write a binary trace of every executed instruction
+	    trace_file = argv[++i];
+	else if (arg == "-restore" && i + 1 < argc)  // Restore a checkpoint before reading commands
+	    checkpoint_file = argv[++i];
+	else if (arg == "-symbols" && i + 1 < argc)  // Symbol map file for the reports
+	    symbol_maps.push_back(argv[++i]);
+	else if (arg == "-harts" && i + 1 < argc)  // Number of harts
+	    hart_count = strtoul(argv[++i], NULL, 10);
+	else if (arg == "-quantum" && i + 1 < argc)  // Instructions each hart runs between meetings
+	    quantum = strtoul(argv[++i], NULL, 10);
+	else if (arg == "-deterministic")  // Run harts in turn on one thread rather than in parallel
+	    parallel = false;
+	else if (arg == "-clint")  // Map a CLINT timer at 0x2000000
+	    clint_present = true;
+	else if (arg == "-uart")  // Map a UART writing to standard output at 0x10000000
+	    uart_present = true;
+	else if (arg == "-finisher")  // Map a test finisher at 0x100000
+	    finisher_present = true;
+	else if (arg == "-block" && i + 1 < argc)  // Map a block device backed by a file at 0x10001000
+	    block_file = argv[++i];
+	else if (arg == "-bench" && i + 1 < argc)  // Benchmark an image file instead of reading commands
+	    bench_file = argv[++i];
+	else if (arg == "-bench-n" && i + 1 < argc)  // Maximum instructions per benchmark iteration
+	    bench_num = strtoul(argv[++i], NULL, 10);
+	else if (arg == "-bench-warmup" && i + 1 < argc)  // Unreported benchmark iterations
+	    bench_warmup = strtoul(argv[++i], NULL, 10);
+	else if (arg == "-bench-iterations" && i + 1 < argc)  // Reported benchmark iterations
+	    bench_iterations = strtoul(argv[++i], NULL, 10);
+	else if (arg == "-bench-break" && i + 1 < argc) {  // Stop benchmark iterations at a (hex) address
+	    bench_breakpoint_present = true;
+	    bench_breakpoint = strtoull(argv[++i], NULL, 16);
+	}
 	else {
 	    cout << argv[0] << ": Unknown option: " << arg << endl;
 	}
     }
 
+    if (!bench_file.empty()) {
+	run_benchmark(bench_file, bench_num, bench_warmup, bench_iterations,
+		      bench_breakpoint_present, bench_breakpoint, block_mode);
+	return 0;
+    }
+
+    if (hart_count < 1 || hart_count > memory::max_ports) {
+	cout << argv[0] << ": Number of harts must be from 1 to " << memory::max_ports << endl;
+	return 1;
+    }
     main_memory = new memory (verbose);
-    cpu = new processor (main_memory, verbose, stage2);
+    harts = new hart_scheduler (main_memory, hart_count, verbose, stage2, quantum, parallel);
+    for (unsigned int i = 0; i < hart_count; i++)
+	harts->get_hart(i)->set_block_mode(block_mode);
+    if (clint_present) {
+	timer = new clint ();
+	for (unsigned int i = 0; i < hart_count; i++)
+	    timer->attach(harts->get_hart(i));
+	main_memory->add_device(clint::default_base, clint::size, timer);
+    }
+    if (uart_present)
+	main_memory->add_device(uart::default_base, uart::size, new uart ());
+    if (finisher_present)
+	main_memory->add_device(test_finisher::default_base, test_finisher::size, new test_finisher (main_memory));
+    if (!block_file.empty()) {
+	block_device* disk = new block_device (main_memory);
+	if (disk->open(block_file))
+	    main_memory->add_device(block_device::default_base, block_device::size, disk);
+	else
+	    cout << argv[0] << ": Cannot open block device file: " << block_file << endl;
+    }
+    // The models observe hart 0 only
+    cpu = harts->get_hart(0);
+    if (cycle_reporting) {
+	pipeline_model* timing = new pipeline_model ();
+	for (unsigned int i = 0; i < timing_settings.size(); i++) {
+	    if (!timing->configure(timing_settings[i]))
+		cout << argv[0] << ": Unknown timing setting: " << timing_settings[i] << endl;
+	}
+	cpu->set_timing_model(timing);
+    }
+    if (!cache_settings.empty()) {
+	caches = new cache_hierarchy ();
+	for (unsigned int i = 0; i < cache_settings.size(); i++)
+	    caches->configure(cache_settings[i]);
+	cpu->set_cache_model(caches);
+    }
+    if (!predictor_settings.empty()) {
+	predictor = new branch_predictor ();
+	for (unsigned int i = 0; i < predictor_settings.size(); i++)
+	    predictor->configure(predictor_settings[i]);
+	predictor->reset();
+	cpu->set_branch_predictor(predictor);
+    }
+    if (!profile_file.empty()) {
+	profile = new profiler ();
+	cpu->set_profiler(profile);
+    }
+    if (!trace_file.empty()) {
+	trace = new trace_writer ();
+	if (trace->open(trace_file))
+	    cpu->set_trace(trace);
+	else
+	    trace = NULL;
+    }
+
+    if (!checkpoint_file.empty())
+	restore_checkpoint(checkpoint_file, main_memory, harts->get_harts());
 
-    interpret_commands(main_memory, cpu, verbose);
+    interpret_commands(main_memory, harts, verbose);
+
+    if (trace != NULL)
+	trace->close();
 
     // Report final statistics
 
-    cpu_instruction_count = cpu->get_instruction_count();
+    cpu_instruction_count = harts->get_instruction_count();
     cout << "Instructions executed: " << dec << cpu_instruction_count << endl;
 
     if (cycle_reporting) {
@@ -62,4 +322,27 @@ int main(int argc, char* argv[]) {
 
 	cout << "CPU cycle count: " << dec << cpu_cycle_count << endl;
     }
+    if (mix_reporting)
+	cpu->print_instruction_mix(cout, false);
+    if (trace != NULL)
+	trace->print_statistics();
+    if (!mix_file.empty()) {
+	ofstream mix(mix_file.c_str());
+	if (mix)
+	    cpu->print_instruction_mix(mix, true);
+	else
+	    cout << argv[0] << ": Cannot write " << mix_file << endl;
+    }
+    // Symbol maps are added after the run, as loading an ELF file replaces the symbols
+    for (unsigned int i = 0; i < symbol_maps.size(); i++)
+	main_memory->load_symbol_map(symbol_maps[i]);
+
+    if (caches != NULL)
+	caches->print_statistics();
+    if (predictor != NULL)
+	predictor->print_statistics(main_memory);
+    if (profile != NULL) {
+	profile->print_statistics(main_memory, profile_top);
+	profile->write_collapsed(profile_file, main_memory);
+    }
 }
@@ -0,0 +1,50 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Trace decoder: prints a binary execution trace as text
+
+**************************************************************** */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <stdlib.h>
+
+#include "trace.h"
+
+using namespace std;
+
+int main(int argc, char* argv[]) {
+
+    if (argc < 2 || argc > 4) {
+	cout << "Usage: " << argv[0] << " TRACE [FIRST [COUNT]]" << endl;
+	return 1;
+    }
+    // Records to skip and to print
+    uint64_t first = argc > 2 ? strtoull(argv[2], NULL, 10) : 0;
+    uint64_t count = argc > 3 ? strtoull(argv[3], NULL, 10) : ~(uint64_t)0;
+
+    trace_reader trace;
+    if (!trace.open(argv[1]))
+	return 1;
+
+    trace_record r;
+    cout << setfill('0') << hex;
+    // Compared as n - first, as first + count wraps when COUNT is omitted
+    for (uint64_t n = 0; (n < first || n - first < count) && trace.next(r); n++) {
+	if (n < first)
+	    continue;
+	cout << setw(16) << r.pc << " (" << setw(8) << r.instruction << ")";
+	if (r.trapped)
+	    cout << " trap";
+	if (r.writes_register)
+	    cout << " x" << dec << (unsigned int)r.rd << hex << " " << setw(16) << r.rd_value;
+	if (r.accesses_memory)
+	    cout << " mem" << dec << (1 << r.size_log2) << hex << " " << setw(16) << r.address
+		 << (r.store ? " <- " : " -> ") << setw(2 << r.size_log2) << r.data;
+	cout << endl;
+    }
+    trace.close();
+    return 0;
+}
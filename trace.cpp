@@ -0,0 +1,306 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Classes for writing and reading binary execution traces
+
+**************************************************************** */
+
+#include <iostream>
+#include <cstring>
+
+#include "trace.h"
+
+using namespace std;
+
+static const char trace_magic[8] = {'R', 'V', '6', '4', 'T', 'R', 'C', '2'};
+
+trace_state::trace_state()
+{
+   last_pc = 0;
+   last_length = 4;
+   for (unsigned int i = 0; i < 32; i++)
+   {
+      registers[i] = 0;
+   }
+   last_address = 0;
+   for (unsigned int i = 0; i < instruction_table_size; i++)
+   {
+      table_pc[i] = 1; // never a valid PC
+      table_instruction[i] = 0;
+   }
+}
+
+static inline uint8_t *put_varint(uint8_t *out, uint64_t value)
+{
+   while (value >= 0x80)
+   {
+      *out++ = (uint8_t)(value | 0x80);
+      value >>= 7;
+   }
+   *out++ = (uint8_t)value;
+   return out;
+}
+
+static inline uint64_t zigzag(uint64_t difference)
+{
+   return (difference << 1) ^ (uint64_t)((int64_t)difference >> 63);
+}
+
+static inline uint64_t unzigzag(uint64_t value)
+{
+   return (value >> 1) ^ (0 - (value & 1));
+}
+
+trace_writer::trace_writer()
+{
+   file = NULL;
+   fill_index = 0;
+   write_index = 0;
+   full = 0;
+   position = 0;
+   stopping = false;
+   records = 0;
+   bytes = 0;
+   waits = 0;
+}
+
+bool trace_writer::open(string file_name)
+{
+   file = fopen(file_name.c_str(), "wb");
+   if (file == NULL)
+   {
+      cout << "Cannot create trace file " << file_name << endl;
+      return false;
+   }
+   buffers.assign(buffer_count, vector<uint8_t>(buffer_size));
+   memcpy(buffers[0].data(), trace_magic, sizeof(trace_magic));
+   position = sizeof(trace_magic);
+   writer = thread(&trace_writer::write_buffers, this);
+   return true;
+}
+
+// Pass the buffer being filled to the writer thread, and wait for the next one to be free
+void trace_writer::hand_over()
+{
+   unique_lock<mutex> guard(lock);
+   buffer_used[fill_index] = position;
+   bytes += position;
+   full++;
+   has_full.notify_one();
+   if (full == buffer_count)
+   {
+      waits++;
+      while (full == buffer_count)
+      {
+         has_space.wait(guard);
+      }
+   }
+   fill_index = (fill_index + 1) % buffer_count;
+   position = 0;
+}
+
+// Body of the writer thread
+void trace_writer::write_buffers()
+{
+   unique_lock<mutex> guard(lock);
+   while (true)
+   {
+      while (full == 0 && !stopping)
+      {
+         has_full.wait(guard);
+      }
+      if (full == 0)
+      {
+         return;
+      }
+      unsigned int index = write_index;
+      guard.unlock();
+      fwrite(buffers[index].data(), 1, buffer_used[index], file);
+      guard.lock();
+      write_index = (write_index + 1) % buffer_count;
+      full--;
+      has_space.notify_one();
+   }
+}
+
+void trace_writer::record(const trace_record &r)
+{
+   uint8_t *start = buffers[fill_index].data() + position;
+   uint8_t *out = start + 1;
+   uint8_t flags = 0;
+   if (r.pc != next_pc())
+   {
+      flags |= trace_pc;
+      out = put_varint(out, zigzag(r.pc - next_pc()));
+   }
+   follow(r.pc, r.instruction);
+   unsigned int slot = table_slot(r.pc);
+   if (table_pc[slot] != r.pc || table_instruction[slot] != r.instruction)
+   {
+      flags |= trace_instruction;
+      memcpy(out, &r.instruction, 4);
+      out += 4;
+      table_pc[slot] = r.pc;
+      table_instruction[slot] = r.instruction;
+   }
+   if (r.trapped)
+   {
+      flags |= trace_trap;
+   }
+   if (r.writes_register)
+   {
+      flags |= trace_register;
+      *out++ = r.rd;
+      out = put_varint(out, zigzag(r.rd_value - registers[r.rd]));
+      registers[r.rd] = r.rd_value;
+   }
+   if (r.accesses_memory)
+   {
+      flags |= trace_memory;
+      *out++ = r.size_log2 | (r.store ? 4 : 0);
+      out = put_varint(out, zigzag(r.address - last_address));
+      out = put_varint(out, r.data);
+      last_address = r.address;
+   }
+   *start = flags;
+   position += out - start;
+   records++;
+   if (position > buffer_size - max_record_size)
+   {
+      hand_over();
+   }
+}
+
+void trace_writer::close()
+{
+   if (file == NULL)
+   {
+      return;
+   }
+   hand_over();
+   {
+      lock_guard<mutex> guard(lock);
+      stopping = true;
+      has_full.notify_one();
+   }
+   writer.join();
+   fclose(file);
+   file = NULL;
+}
+
+void trace_writer::print_statistics()
+{
+   cout << "Trace: " << dec << records << " records, " << bytes << " bytes";
+   if (records != 0)
+   {
+      cout << " (" << (double)bytes / records << " bytes per record)";
+   }
+   cout << ", " << waits << " waits for the disk" << endl;
+}
+
+trace_reader::trace_reader()
+{
+   file = NULL;
+}
+
+bool trace_reader::open(string file_name)
+{
+   file = fopen(file_name.c_str(), "rb");
+   if (file == NULL)
+   {
+      cout << "Cannot open trace file " << file_name << endl;
+      return false;
+   }
+   char magic[sizeof(trace_magic)];
+   if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, trace_magic, sizeof(magic)) != 0)
+   {
+      cout << file_name << " is not a trace file" << endl;
+      fclose(file);
+      file = NULL;
+      return false;
+   }
+   return true;
+}
+
+bool trace_reader::read_varint(uint64_t &value)
+{
+   value = 0;
+   for (unsigned int shift = 0; shift < 64; shift += 7)
+   {
+      int byte = getc(file);
+      if (byte == EOF)
+      {
+         return false;
+      }
+      value |= (uint64_t)(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0)
+      {
+         return true;
+      }
+   }
+   return false;
+}
+
+bool trace_reader::next(trace_record &r)
+{
+   int flags = getc(file);
+   if (flags == EOF)
+   {
+      return false;
+   }
+   bool complete = true;
+   uint64_t value = 0;
+   r.pc = next_pc();
+   if (flags & trace_pc)
+   {
+      complete = complete && read_varint(value);
+      r.pc += unzigzag(value);
+   }
+   unsigned int slot = table_slot(r.pc);
+   if (flags & trace_instruction)
+   {
+      complete = complete && fread(&r.instruction, 1, 4, file) == 4;
+      table_pc[slot] = r.pc;
+      table_instruction[slot] = r.instruction;
+   }
+   else
+   {
+      r.instruction = table_instruction[slot];
+   }
+   follow(r.pc, r.instruction);
+   r.trapped = (flags & trace_trap) != 0;
+   r.writes_register = (flags & trace_register) != 0;
+   if (r.writes_register)
+   {
+      int rd = getc(file);
+      complete = complete && rd != EOF && read_varint(value);
+      r.rd = rd & 31;
+      r.rd_value = registers[r.rd] + unzigzag(value);
+      registers[r.rd] = r.rd_value;
+   }
+   r.accesses_memory = (flags & trace_memory) != 0;
+   if (r.accesses_memory)
+   {
+      int kind = getc(file);
+      complete = complete && kind != EOF && read_varint(value) && read_varint(r.data);
+      r.size_log2 = kind & 3;
+      r.store = (kind & 4) != 0;
+      r.address = last_address + unzigzag(value);
+      last_address = r.address;
+   }
+   if (!complete)
+   {
+      cout << "Trace file is truncated" << endl;
+   }
+   return complete;
+}
+
+void trace_reader::close()
+{
+   if (file != NULL)
+   {
+      fclose(file);
+      file = NULL;
+   }
+}
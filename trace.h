@@ -0,0 +1,149 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Classes for writing and reading binary execution traces
+
+**************************************************************** */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+// One executed instruction. An instruction that traps has no register write or memory access.
+struct trace_record
+{
+   uint64_t pc;
+   uint32_t instruction;
+   bool trapped;
+   bool writes_register;
+   uint8_t rd;
+   uint64_t rd_value;
+   bool accesses_memory;
+   bool store;
+   uint8_t size_log2;
+   uint64_t address;
+   uint64_t data;
+};
+
+// A trace file starts with the 8 byte magic "RV64TRC2", followed by one record per instruction:
+// a flags byte, then the fields the flags call for, with numbers as LEB128 varints and signed
+// differences zigzag encoded. Writer and reader keep the same state to encode against: the
+// previous PC and the length of its instruction, the last value written to each register, the
+// previous memory address, and a direct-mapped table of the instruction word last seen at each PC.
+// A compressed instruction is recorded as its 16-bit encoding, zero-extended.
+enum trace_flags
+{
+   trace_pc = 1,          // PC does not follow the previous instruction: difference follows
+   trace_instruction = 2, // instruction word is not in the table: 4 bytes follow
+   trace_register = 4,    // register write: rd byte and difference from its last value follow
+   trace_memory = 8,      // memory access: size and direction byte, address difference and data follow
+   trace_trap = 16        // the instruction trapped
+};
+
+// State shared by the encoder and decoder
+class trace_state
+{
+
+protected:
+   static const unsigned int instruction_table_size = 4096;
+
+   uint64_t last_pc;
+   unsigned int last_length;
+   uint64_t registers[32];
+   uint64_t last_address;
+   uint64_t table_pc[instruction_table_size];
+   uint32_t table_instruction[instruction_table_size];
+
+   trace_state();
+
+   // Address following the previous instruction
+   uint64_t next_pc() { return last_pc + last_length; }
+   // Remember an instruction as the previous one
+   void follow(uint64_t pc, uint32_t instruction)
+   {
+      last_pc = pc;
+      last_length = (instruction & 3) == 3 ? 4 : 2;
+   }
+   static unsigned int table_slot(uint64_t pc) { return (pc >> 1) % instruction_table_size; }
+};
+
+// Writes records to a trace file from a background thread, through a bounded ring of buffers.
+// Recording only waits for the disk when every buffer is full.
+class trace_writer : private trace_state
+{
+
+private:
+   static const unsigned int buffer_count = 8;
+   static const size_t buffer_size = 1 << 20;
+   // Largest encoded record, so a record always fits once this much space is left
+   static const size_t max_record_size = 64;
+
+   FILE *file;
+   vector<vector<uint8_t> > buffers;
+   size_t buffer_used[buffer_count];
+   unsigned int fill_index;  // buffer being filled by record
+   unsigned int write_index; // next buffer to write
+   unsigned int full;        // buffers handed to the writer thread and not yet written
+   size_t position;
+   bool stopping;
+   mutex lock;
+   condition_variable has_full;
+   condition_variable has_space;
+   thread writer;
+
+   uint64_t records;
+   uint64_t bytes;
+   uint64_t waits;
+
+   void hand_over();
+   void write_buffers();
+
+public:
+   // Constructor
+   trace_writer();
+
+   // Start tracing to a file. Print a message and return false if it cannot be created.
+   bool open(string file_name);
+
+   void record(const trace_record &r);
+
+   // Write any buffered records, stop the writer thread and close the file
+   void close();
+
+   void print_statistics();
+};
+
+// Reads records back from a trace file
+class trace_reader : private trace_state
+{
+
+private:
+   FILE *file;
+
+   bool read_varint(uint64_t &value);
+
+public:
+   // Constructor
+   trace_reader();
+
+   // Open a trace file. Print a message and return false if it cannot be read or is not a trace.
+   bool open(string file_name);
+
+   // Read the next record. Return false at the end of the trace, printing a message if the
+   // file is truncated.
+   bool next(trace_record &r);
+
+   void close();
+};
+
+#endif